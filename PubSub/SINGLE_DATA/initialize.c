@@ -139,6 +139,7 @@ local process	startup(void)
 	/* Startup process exits at this point */
 	//start broker
 	resume(create((void *)broker, 4096, 50, "broker_service", 0));	
+	resume(create((void *)pschan_broker, 4096, 50, "pschan_broker", 0));
 	
 	return OK;
 }
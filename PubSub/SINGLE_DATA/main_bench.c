@@ -0,0 +1,130 @@
+/*  main_bench.c  - main */
+#include <xinu.h>
+
+/* BENCH_VALS - Number of values published per benchmark run */
+#define BENCH_VALS 1000
+/* BENCH_TOPIC - Topic of the publish() run (group 1 topic 2) */
+#define BENCH_TOPIC 0x0102
+/* BENCH_CHAN_TOPIC - Topic of the typed channel run (group 1 topic 3) */
+#define BENCH_CHAN_TOPIC 0x0103
+
+extern sid32 print_mutex;
+
+/* Values and handler calls seen by the benchmark handlers */
+volatile uint32 bench_recv = 0;
+uint32 bench_calls = 0;
+
+/*-------------------------------------------------------------------------------
+ * bench_callback - count values delivered one per call by publish()
+ *--------------------------------------------------------------------------------
+ */
+void bench_callback(topic16 topic, uint32 data)
+{
+	bench_calls++;
+	bench_recv++;
+}
+
+/*-------------------------------------------------------------------------------
+ * bench_u32_callback - count values delivered in runs by publish_u32()
+ *--------------------------------------------------------------------------------
+ */
+void bench_u32_callback(topic16 topic, const uint32 *vals, uint32 n)
+{
+	bench_calls++;
+	bench_recv += n;
+}
+
+/*------------------------------------------------------------------------------------
+ * bench_report - print publishing and delivery ticks of one run
+ *------------------------------------------------------------------------------------
+ */
+void bench_report(char *name, uint32 pubticks, uint32 ticks, uint32 retries)
+{
+	wait(print_mutex);
+	printf("bench %s: %d values, %d ticks publishing, %d ticks delivered, %d handler calls, %d retries\n",
+		name, BENCH_VALS, pubticks, ticks, bench_calls, retries);
+	signal(print_mutex);
+}
+
+/*------------------------------------------------------------------------------------
+ * bench_publish - ticks to publish and deliver BENCH_VALS values with publish()
+ *------------------------------------------------------------------------------------
+ */
+void bench_publish(void)
+{
+	uint32 start;
+	uint32 pubticks;
+	uint32 i = 0;
+
+	bench_recv = 0;
+	bench_calls = 0;
+	subscribe(BENCH_TOPIC, &bench_callback);
+
+	start = getticks();
+	for(i = 0; i < BENCH_VALS; i++) {
+		publish(BENCH_TOPIC, i);
+	}
+	pubticks = getticks() - start;
+	while(bench_recv < BENCH_VALS) {
+		resched();
+	}
+	bench_report("publish", pubticks, getticks() - start, 0);
+	unsubscribe(BENCH_TOPIC);
+}
+
+/*------------------------------------------------------------------------------------
+ * bench_u32 - ticks to publish and deliver BENCH_VALS values with publish_u32(),
+ *             retrying values published to a full ring
+ *------------------------------------------------------------------------------------
+ */
+void bench_u32(void)
+{
+	uint32 start;
+	uint32 pubticks;
+	uint32 retries = 0;
+	uint32 i = 0;
+
+	bench_recv = 0;
+	bench_calls = 0;
+	subscribe_u32(BENCH_CHAN_TOPIC, &bench_u32_callback);
+
+	start = getticks();
+	for(i = 0; i < BENCH_VALS; i++) {
+		while(publish_u32(BENCH_CHAN_TOPIC, i) == SYSERR) {
+			retries++;
+			resched();
+		}
+	}
+	pubticks = getticks() - start;
+	while(bench_recv < BENCH_VALS) {
+		resched();
+	}
+	bench_report("publish_u32", pubticks, getticks() - start, retries);
+	unsubscribe_u32(BENCH_CHAN_TOPIC);
+}
+
+/*------------------------------------------------------------------------------------
+ * bench_run - run the benchmarks at the priority of the broker processes, which
+ *             lower priority processes would not get the CPU from
+ *------------------------------------------------------------------------------------
+ */
+process bench_run(void)
+{
+	bench_publish();
+	bench_u32();
+	return OK;
+}
+
+/*------------------------------------------------------------------------------------
+ * main - Throughput of publish() against the typed channel fast path, link in
+ *        place of main.c
+ *------------------------------------------------------------------------------------
+ */
+process	main(void)
+{
+	recvclr();
+
+	resume(create(bench_run, 4096, 50, "bench_run", 0));
+
+	return OK;
+}
@@ -606,3 +606,11 @@ extern syscall unsubscribe(topic16);
 extern syscall publish(topic16, uint32);
 extern syscall pubsub_init(void);
 extern syscall unsubscribe_pub_sub(pid32);
+
+/* in file pubchan.c */
+extern syscall subscribe_u32(topic16, void (*handler)(topic16, const uint32 *, uint32));
+extern syscall unsubscribe_u32(topic16);
+extern syscall publish_u32(topic16, uint32);
+extern void pschan_u32_kill(pid32);
+extern void pschan_init(void);
+extern process pschan_broker(void);
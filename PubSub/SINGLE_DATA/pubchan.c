@@ -0,0 +1,271 @@
+/* pubchan.c - subscribe_u32, unsubscribe_u32, publish_u32, pschan_broker */
+#include <xinu.h>
+
+/*-------------------------------------------------------------------------
+ * Typed channels
+ *
+ * A fast path next to publish() for topics carrying fixed-width values.
+ * Each topic gets its own ring of values, allocated on the first
+ * subscribe and kept afterwards, so publishing only stores the value and
+ * its group in the ring with interrupts disabled: no mutex, no allocation
+ * and no console output. A channel going from empty to non-empty is put
+ * on a ready list and wakes the channel broker once, which hands every
+ * run of values published to the same group to the handlers in one call:
+ *   handler(topic, vals, n)
+ * vals points into the ring and is valid only until the handler returns.
+ * PSCHAN_DEFINE generates the functions for one value width, the channel
+ * structure comes from PSCHAN_STRUCT in pubsub.h.
+ *--------------------------------------------------------------------------
+ */
+
+extern sid32 mutex;
+
+/* channels with values waiting for the broker */
+local struct pschan *pschan_rhead;
+local struct pschan *pschan_rtail;
+/* counts channels on the ready list */
+local sid32 pschan_ready;
+
+/*-------------------------------------------------------------------------
+ * pschan_queue - put a channel on the ready list and wake the broker,
+ *                interrupts disabled
+ *--------------------------------------------------------------------------
+ */
+local void pschan_queue(struct pschan *ch)
+{
+	ch->queued = TRUE;
+	ch->rnext = NULL;
+	if(pschan_rtail == NULL) {
+		pschan_rhead = ch;
+	} else {
+		pschan_rtail->rnext = ch;
+	}
+	pschan_rtail = ch;
+	signal(pschan_ready);
+}
+
+/*-------------------------------------------------------------------------
+ * PSCHAN_DEFINE - generate subscribe_<name>, unsubscribe_<name>,
+ *                 publish_<name> and pschan_<name>_kill for values of
+ *                 type type
+ *--------------------------------------------------------------------------
+ */
+#define PSCHAN_DEFINE(name, type)					\
+									\
+/* channel of each topic, NULL until first subscribed */		\
+local struct pschan_##name *pschan_##name##_tab[MAX_TOPIC];		\
+									\
+/* hand the values queued on a channel to its handlers, called	\
+   without mutex held so handlers may subscribe and publish */		\
+local void pschan_##name##_drain(struct pschan *hdr)			\
+{									\
+	struct pschan_##name *ch = (struct pschan_##name *) hdr;	\
+	void (*handlers[MAX_SUBSCRIBER])(topic16, const type *, uint32); \
+	intmask mask;							\
+	uint32 head, tail;						\
+	uint32 first, n;						\
+	uint32 group_id;						\
+	uint32 nhandlers;						\
+	uint32 i = 0;							\
+									\
+	while(1) {							\
+		mask = disable();					\
+		head = ch->head;					\
+		tail = ch->tail;					\
+		if(head == tail) {					\
+			ch->hdr.queued = FALSE;				\
+			restore(mask);					\
+			break;						\
+		}							\
+		restore(mask);						\
+									\
+		/* run of one group, not crossing the end of the ring */\
+		first = head & (PSCHAN_SIZE - 1);			\
+		group_id = ch->groups[first];				\
+		n = 1;							\
+		while(head + n != tail && first + n < PSCHAN_SIZE	\
+		    && ch->groups[first + n] == group_id) {		\
+			n++;						\
+		}							\
+									\
+		/* snapshot the handlers of the run's group */		\
+		nhandlers = 0;						\
+		wait(mutex);						\
+		for(i = 0; i < ch->nsubs; i++) {			\
+			if(group_id == 0 || ch->subs[i].group_id == group_id) { \
+				handlers[nhandlers++] = ch->subs[i].handler; \
+			}						\
+		}							\
+		signal(mutex);						\
+									\
+		for(i = 0; i < nhandlers; i++) {			\
+			handlers[i]((group_id << 8) + ch->topic_id,	\
+				&ch->vals[first], n);			\
+		}							\
+		/* slots are reused only after the handlers are done */	\
+		ch->head = head + n;					\
+	}								\
+}									\
+									\
+/* subscribe a function to values of a group and topic */		\
+syscall subscribe_##name(topic16 topic,					\
+		void (*handler)(topic16, const type *, uint32))		\
+{									\
+	struct pschan_##name *ch;					\
+	uint32 topic_id = topic & 0x00FF;				\
+	uint32 group_id = (topic >> 8) & 0x00FF;			\
+	uint32 i = 0;							\
+									\
+	wait(mutex);							\
+	ch = pschan_##name##_tab[topic_id];				\
+	if(ch == NULL) {						\
+		ch = (struct pschan_##name *) getmem(sizeof(struct pschan_##name)); \
+		if(ch == (struct pschan_##name *) SYSERR) {		\
+			signal(mutex);					\
+			return SYSERR;					\
+		}							\
+		ch->hdr.rnext = NULL;					\
+		ch->hdr.queued = FALSE;					\
+		ch->hdr.drain = pschan_##name##_drain;			\
+		ch->topic_id = topic_id;				\
+		ch->head = 0;						\
+		ch->tail = 0;						\
+		ch->dropped = 0;					\
+		ch->nsubs = 0;						\
+		pschan_##name##_tab[topic_id] = ch;			\
+	}								\
+									\
+	for(i = 0; i < ch->nsubs; i++) {				\
+		if(ch->subs[i].pid == getpid()) {			\
+			signal(mutex);					\
+			return SYSERR;					\
+		}							\
+	}								\
+	if(ch->nsubs == MAX_SUBSCRIBER) {				\
+		signal(mutex);						\
+		return SYSERR;						\
+	}								\
+	ch->subs[ch->nsubs].pid = getpid();				\
+	ch->subs[ch->nsubs].group_id = group_id;			\
+	ch->subs[ch->nsubs].handler = handler;				\
+	ch->nsubs++;							\
+	signal(mutex);							\
+	return OK;							\
+}									\
+									\
+/* remove subscriber i of a channel, mutex held */			\
+local void pschan_##name##_remove(struct pschan_##name *ch, uint32 i)	\
+{									\
+	ch->nsubs--;							\
+	ch->subs[i] = ch->subs[ch->nsubs];				\
+}									\
+									\
+/* unsubscribe from values of a group and topic */			\
+syscall unsubscribe_##name(topic16 topic)				\
+{									\
+	struct pschan_##name *ch;					\
+	uint32 topic_id = topic & 0x00FF;				\
+	uint32 group_id = (topic >> 8) & 0x00FF;			\
+	uint32 i = 0;							\
+									\
+	wait(mutex);							\
+	ch = pschan_##name##_tab[topic_id];				\
+	for(i = 0; ch != NULL && i < ch->nsubs; i++) {			\
+		if(ch->subs[i].pid == getpid() && ch->subs[i].group_id == group_id) { \
+			pschan_##name##_remove(ch, i);			\
+			signal(mutex);					\
+			return OK;					\
+		}							\
+	}								\
+	signal(mutex);							\
+	return SYSERR;							\
+}									\
+									\
+/* publish a value to a group and topic, never blocks */		\
+syscall publish_##name(topic16 topic, type val)				\
+{									\
+	struct pschan_##name *ch;					\
+	intmask mask;							\
+	uint32 tail;							\
+									\
+	ch = pschan_##name##_tab[topic & 0x00FF];			\
+	if(ch == NULL) {						\
+		/* never subscribed, nobody to deliver to */		\
+		return OK;						\
+	}								\
+									\
+	mask = disable();						\
+	tail = ch->tail;						\
+	if(tail - ch->head == PSCHAN_SIZE) {				\
+		ch->dropped++;						\
+		restore(mask);						\
+		return SYSERR;						\
+	}								\
+	ch->vals[tail & (PSCHAN_SIZE - 1)] = val;			\
+	ch->groups[tail & (PSCHAN_SIZE - 1)] = (topic >> 8) & 0x00FF;	\
+	ch->tail = tail + 1;						\
+	if(!ch->hdr.queued) {						\
+		pschan_queue(&ch->hdr);					\
+	}								\
+	restore(mask);							\
+	return OK;							\
+}									\
+									\
+/* remove the subscriptions of a terminating process */			\
+void pschan_##name##_kill(pid32 pid)					\
+{									\
+	struct pschan_##name *ch;					\
+	uint32 t = 0;							\
+	uint32 i = 0;							\
+									\
+	wait(mutex);							\
+	for(t = 0; t < MAX_TOPIC; t++) {				\
+		ch = pschan_##name##_tab[t];				\
+		for(i = 0; ch != NULL && i < ch->nsubs; i++) {		\
+			if(ch->subs[i].pid == pid) {			\
+				pschan_##name##_remove(ch, i);		\
+				break;					\
+			}						\
+		}							\
+	}								\
+	signal(mutex);							\
+}
+
+PSCHAN_DEFINE(u32, uint32)
+
+/*-------------------------------------------------------------------------
+ * pschan_init - initialize the channel ready list
+ *--------------------------------------------------------------------------
+ */
+void pschan_init(void)
+{
+	pschan_rhead = NULL;
+	pschan_rtail = NULL;
+	pschan_ready = semcreate(0);
+}
+
+/*-------------------------------------------------------------------------
+ * pschan_broker - drain channels as they become ready, sleeps while no
+ *                 values are queued
+ *--------------------------------------------------------------------------
+ */
+process pschan_broker(void)
+{
+	struct pschan *ch;
+	intmask mask;
+
+	while(1) {
+		wait(pschan_ready);
+
+		mask = disable();
+		ch = pschan_rhead;
+		pschan_rhead = ch->rnext;
+		if(pschan_rhead == NULL) {
+			pschan_rtail = NULL;
+		}
+		restore(mask);
+
+		ch->drain(ch);
+	}
+	return OK;
+}
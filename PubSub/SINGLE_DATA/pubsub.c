@@ -229,6 +229,8 @@ syscall pubsub_init()
 	publishq->count = 0;
 	publishq->tail = 0;
 
+	pschan_init();
+
 	return OK;
 }
 	
@@ -248,6 +250,7 @@ syscall unsubscribe_pub_sub(pid32 pid)
 			}
 		}
 	}
+	pschan_u32_kill(pid);
 
 }
 
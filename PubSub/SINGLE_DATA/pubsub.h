@@ -32,3 +32,38 @@ struct pubqueue {
 	uint32 tail;
 	uint32 count;	
 };
+
+/* values each typed channel ring holds, power of 2 */
+#define PSCHAN_SIZE 64
+
+//typed channel part shared by every value width, see pubchan.c
+struct pschan {
+	struct pschan *rnext;	/* next channel on the ready list */
+	bool8 queued;		/* channel is on the ready list */
+	void (*drain)(struct pschan *);	/* hands queued values to handlers */
+};
+
+/*-------------------------------------------------------------------------
+ * PSCHAN_STRUCT - typed channel of one topic for values of type type: a
+ *                 ring of values with the group each was published to,
+ *                 and subscribers taking arrays of values
+ *--------------------------------------------------------------------------
+ */
+#define PSCHAN_STRUCT(name, type)					\
+struct pschan_##name {							\
+	struct pschan hdr;						\
+	uint32 topic_id;						\
+	volatile uint32 head;	/* next value broker hands out */	\
+	volatile uint32 tail;	/* next free value */			\
+	uint32 dropped;		/* values published to a full ring */	\
+	type vals[PSCHAN_SIZE];						\
+	uint8 groups[PSCHAN_SIZE];					\
+	uint32 nsubs;							\
+	struct {							\
+		pid32 pid;						\
+		uint32 group_id;					\
+		void (*handler)(topic16, const type *, uint32);		\
+	} subs[MAX_SUBSCRIBER];						\
+};
+
+PSCHAN_STRUCT(u32, uint32)
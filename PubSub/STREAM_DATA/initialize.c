@@ -14,7 +14,7 @@ extern	void main(void);	/* Main is the first process created	*/
 static	void sysinit(); 	/* Internal system initialization	*/
 extern	void meminit(void);	/* Initializes the free memory list	*/
 local	process startup(void);	/* Process to finish startup tasks	*/
-extern void broker();           /* Process for pubsub eventing  */
+extern void broker(uint32);     /* Process for pubsub eventing  */
 
 
 /* Declarations of major kernel variables */
@@ -110,6 +110,7 @@ local process	startup(void)
 {
 	uint32	ipaddr;			/* Computer's IP address	*/
 	char	str[128];		/* String used to format output	*/
+	uint32	shard;			/* Pubsub shard of a broker	*/
 
 
 	/* Use DHCP to obtain an IP address and format it */
@@ -129,7 +130,7 @@ local process	startup(void)
 	}
 
 	/* Initilize datastructures for publisher subscriber */
-	pubsub_init();
+	pubsub_init(PUBSUB_SHARDS);
 	
 	/* Create a process to execute function main() */
 
@@ -137,8 +138,14 @@ local process	startup(void)
 					"Main process", 0, NULL));
 
 	/* Startup process exits at this point */
-	//start broker
-	resume(create((void *)broker, 4096, 50, "broker_service", 0));	
+	//start one broker per shard
+	for (shard = 0; shard < PUBSUB_SHARDS; shard++) {
+		resume(create((void *)broker, 4096, 50, "broker_service", 1, shard));
+	}
+	//format pubsub trace records when nothing else runs
+	if (PSTRACE_LEVEL > PSTRACE_OFF) {
+		resume(create((void *)pstrace_logger, 4096, PSTRACE_PRIO, "pubsub_trace", 0));
+	}
 
 	
 	return OK;
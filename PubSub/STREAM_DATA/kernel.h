@@ -73,3 +73,5 @@ syscall	kputc(byte);
 syscall	kgetc(void);
 
 typedef uint16 topic16;
+/* 24-bit topic id with group in bits 8..15, any topic16 is a valid topic32 */
+typedef uint32 topic32;
@@ -78,6 +78,7 @@ process subscriber_2(void)
 process publisher(void)
 {
 	char data[5] = {1,2,3,4,5};
+	char *buf;
 	
 	//group 1 topic 1
 	publish(0x0101, (void *) data, 5);
@@ -89,6 +90,14 @@ process publisher(void)
 	// wildcard group
 	data[0] = 9;
 	publish(0x0001, (void *) data, 5);
+
+	// zero-copy publish, buffer is freed after the last handler
+	buf = pubbuf_alloc(5);
+	if(buf != (char *) SYSERR) {
+		memcpy(buf, data, 5);
+		buf[0] = 7;
+		publish_buf(0x0101, buf);
+	}
 		
 }
 
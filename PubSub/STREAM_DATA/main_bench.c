@@ -0,0 +1,1124 @@
+/*  main_bench.c  - main */
+#include <xinu.h>
+#include <stdarg.h>
+
+/* BENCH_MSGS - Number of publications issued per benchmark run */
+#define BENCH_MSGS 100
+/* BENCH_IDLE_MS - Length of the idle CPU measurement window */
+#define BENCH_IDLE_MS 2000
+/* BENCH_TOPIC - Topic used by the benchmark processes (group 1 topic 2) */
+#define BENCH_TOPIC 0x0102
+/* BENCH_TPUT_TOPIC - Topic without subscribers for throughput runs */
+#define BENCH_TPUT_TOPIC 0x0103
+/* BENCH_MAX_PAYLOAD - Largest payload used by the throughput run */
+#define BENCH_MAX_PAYLOAD 256
+/* BENCH_KILL_TOPICS - Topics subscribed by the process killed in the kill run */
+#define BENCH_KILL_TOPICS 128
+/* BENCH_STRESS_TOPIC - Topic of the concurrent publisher stress run */
+#define BENCH_STRESS_TOPIC 0x0104
+/* BENCH_STRESS_PUBS - Largest number of concurrent publishers */
+#define BENCH_STRESS_PUBS 8
+/* BENCH_STRESS_MSGS - Publications per publisher in the stress run */
+#define BENCH_STRESS_MSGS 500
+/* BENCH_SHARD_TOPIC - First of BENCH_SHARD_TOPICS topics of the shard run */
+#define BENCH_SHARD_TOPIC 0x0120
+#define BENCH_SHARD_TOPICS 8
+/* BENCH_SHARD_MSGS - Publications per topic in the shard run */
+#define BENCH_SHARD_MSGS 20
+/* BENCH_SHARD_WORK_MS - Time the shard run handler blocks per delivery */
+#define BENCH_SHARD_WORK_MS 2
+/* BENCH_BULK_TOPIC, BENCH_CTRL_TOPIC - Bulk and control topics of the priority run */
+#define BENCH_BULK_TOPIC 0x0130
+#define BENCH_CTRL_TOPIC 0x0131
+/* BENCH_PRIO_MSGS - Bulk publications in the priority run, one control per 10 */
+#define BENCH_PRIO_MSGS 100
+/* BENCH_SLOW_TOPIC, BENCH_FAST_TOPIC - Topics with slow and fast handlers in the
+   mailbox run */
+#define BENCH_SLOW_TOPIC 0x0140
+#define BENCH_FAST_TOPIC 0x0141
+/* BENCH_MBOX_MSGS - Publications per topic in the mailbox run, fits a mailbox */
+#define BENCH_MBOX_MSGS 20
+/* BENCH_RETAIN_TOPIC - Topic with retained payloads for the late subscriber run */
+#define BENCH_RETAIN_TOPIC 0x0150
+/* BENCH_CONFLATE_TOPIC - Sensor style topic of the conflation run */
+#define BENCH_CONFLATE_TOPIC 0x0160
+/* BENCH_WIDE_TOPIC - topic32 beyond the topic16 range, group 1 */
+#define BENCH_WIDE_TOPIC PSTOPIC(0x123456, 1)
+/* BENCH_TRIE_PATH - Path published in the wildcard run, BENCH_TRIE_OTHERS - filters
+   of the run that never match it */
+#define BENCH_TRIE_PATH "sensors/kitchen/temp"
+#define BENCH_TRIE_OTHERS 32
+/* BENCH_FANOUT_TOPIC - Topic of the fan-out run, BENCH_FANOUT_SUBS - its subscribers */
+#define BENCH_FANOUT_TOPIC 0x0170
+#define BENCH_FANOUT_SUBS 48
+/* BENCH_FIXED_SLOTS - Subscriber slots a topic entry embedded before they were
+   allocated per topic, for the memory comparison */
+#define BENCH_FIXED_SLOTS 8
+/* BENCH_FILTER_TOPIC - Topic of the content filter run, BENCH_FILTER_SUBS - its
+   subscribers, each wanting one publication in BENCH_FILTER_EVERY */
+#define BENCH_FILTER_TOPIC 0x0180
+#define BENCH_FILTER_SUBS 8
+#define BENCH_FILTER_EVERY 8
+/* BENCH_STREAM_TOPIC - Topic of the streaming run, BENCH_STREAM_SIZE - bytes of each
+   of its BENCH_STREAM_MSGS payloads */
+#define BENCH_STREAM_TOPIC 0x0190
+#define BENCH_STREAM_SIZE 4096
+#define BENCH_STREAM_MSGS 10
+/* BENCH_PUBV_TOPIC - Topic of the batch publish run, BENCH_PUBV_MSGS - messages
+   per batch, published BENCH_PUBV_ROUNDS times */
+#define BENCH_PUBV_TOPIC 0x01A0
+#define BENCH_PUBV_MSGS 32
+#define BENCH_PUBV_ROUNDS 20
+/* BENCH_SUB_STACK - Stack of the bench_sub() subscriber processes */
+#define BENCH_SUB_STACK 2048
+
+extern sid32 print_mutex;
+extern void _fdoprnt(char *, va_list, int (*)(int, int), int);
+extern uint32 pstopic_count;
+extern struct pubsubent *pstopics[];
+
+/* Idle loop state - counts iterations of the background process */
+volatile uint32 bench_running = 0;
+volatile uint32 bench_idle_count = 0;
+
+/* Latency accumulated by the benchmark handler, in clock ticks */
+uint32 bench_delivered = 0;
+uint32 bench_lat_sum = 0;
+uint32 bench_lat_min = 0xFFFFFFFF;
+uint32 bench_lat_max = 0;
+
+/*-------------------------------------------------------------------------------
+ * bench_callback - record publish-to-handler latency of one publication
+ *--------------------------------------------------------------------------------
+ */
+void bench_callback(topic16 topic, void *data, uint32 size)
+{
+	uint32 stamp;
+	uint32 latency;
+
+	if(size < sizeof(uint32)) {
+		return;
+	}
+	memcpy(&stamp, data, sizeof(uint32));
+	latency = getticks() - stamp;
+
+	bench_delivered++;
+	bench_lat_sum += latency;
+	if(latency < bench_lat_min) {
+		bench_lat_min = latency;
+	}
+	if(latency > bench_lat_max) {
+		bench_lat_max = latency;
+	}
+}
+
+/*------------------------------------------------------------------------------------
+ * bench_idle - background process which counts the CPU left over by pubsub
+ *------------------------------------------------------------------------------------
+ */
+process bench_idle(void)
+{
+	while(bench_running) {
+		bench_idle_count++;
+	}
+	return OK;
+}
+
+/*------------------------------------------------------------------------------------
+ * bench_report - print a result line of a run, whole even while other processes
+ *                print
+ *------------------------------------------------------------------------------------
+ */
+void bench_report(char *fmt, ...)
+{
+	va_list ap;
+
+	wait(print_mutex);
+	va_start(ap, fmt);
+	_fdoprnt(fmt, ap, (int (*)(int, int)) putc, stdout);
+	va_end(ap);
+	signal(print_mutex);
+}
+
+/*------------------------------------------------------------------------------------
+ * bench_sub - subscriber of the runs: subscribe handler to ntopics topics from
+ *             topic on, in mailbox mode or behind filter when given, report the
+ *             result to parent and stay subscribed until killed
+ *------------------------------------------------------------------------------------
+ */
+process bench_sub(pid32 parent, topic16 topic, int32 ntopics,
+		void (*handler)(topic16, void *, uint32), bool8 mbox, struct psfilter *filter)
+{
+	status result = OK;
+	status retval;
+	int32 i = 0;
+
+	for(i = 0; i < ntopics; i++) {
+		if(mbox) {
+			retval = subscribe_mbox(topic + i, handler);
+		} else if(filter != NULL) {
+			retval = subscribe_filter(topic + i, handler, filter);
+		} else {
+			retval = subscribe(topic + i, handler);
+		}
+		if(retval == SYSERR) {
+			result = SYSERR;
+		}
+	}
+	send(parent, result);
+	while(1) {
+		// in mailbox mode the handler runs here
+		if(mbox) {
+			pubsub_receive();
+		} else {
+			sleep(10);
+		}
+	}
+	return OK;
+}
+
+/*------------------------------------------------------------------------------------
+ * bench_spawn - start a bench_sub() process and wait until it has subscribed,
+ *               SYSERR in *result when a subscribe failed
+ *------------------------------------------------------------------------------------
+ */
+pid32 bench_spawn(topic16 topic, int32 ntopics, void (*handler)(topic16, void *, uint32),
+		bool8 mbox, struct psfilter *filter, status *result)
+{
+	pid32 pid;
+	umsg32 msg;
+
+	pid = create(bench_sub, BENCH_SUB_STACK, 50, "bench_sub", 6, getpid(), topic, ntopics,
+		handler, mbox, filter);
+	if(pid == SYSERR) {
+		if(result != NULL) {
+			*result = SYSERR;
+		}
+		return SYSERR;
+	}
+	resume(pid);
+	msg = receive();
+	if(result != NULL) {
+		*result = (msg == OK) ? OK : SYSERR;
+	}
+	return pid;
+}
+
+/*------------------------------------------------------------------------------------
+ * bench_publisher - publish timestamped payloads, one every millisecond
+ *------------------------------------------------------------------------------------
+ */
+process bench_publisher(void)
+{
+	uint32 stamp;
+	int32 i = 0;
+
+	for(i = 0; i < BENCH_MSGS; i++) {
+		stamp = getticks();
+		publish(BENCH_TOPIC, (void *) &stamp, sizeof(uint32));
+		sleepms(1);
+	}
+	return OK;
+}
+
+/* Payload sizes for the throughput run, both sides of PUBSUB_INLINE_MAX */
+uint32 bench_sizes[] = { 4, 16, PUBSUB_INLINE_MAX, PUBSUB_INLINE_MAX + 1, 64, 128, BENCH_MAX_PAYLOAD };
+char bench_payload[BENCH_MAX_PAYLOAD];
+
+/*------------------------------------------------------------------------------------
+ * bench_throughput - ticks per publish() for each payload size
+ *------------------------------------------------------------------------------------
+ */
+void bench_throughput(void)
+{
+	uint32 start;
+	uint32 ticks;
+	int32 i = 0, j = 0;
+
+	// publications are only queued for topics in the topic table, which a
+	// topic without subscribers is kept in by a setting
+	pubsub_settopicprio(BENCH_TPUT_TOPIC, PSPRIO_BULK);
+	for(i = 0; i < sizeof(bench_sizes) / sizeof(bench_sizes[0]); i++) {
+		start = getticks();
+		for(j = 0; j < BENCH_MSGS; j++) {
+			publish(BENCH_TPUT_TOPIC, (void *) bench_payload, bench_sizes[i]);
+		}
+		ticks = getticks() - start;
+		// let broker drain before the next size
+		sleepms(100);
+
+		bench_report("bench throughput: size=%d %s %d ticks/publish\n", bench_sizes[i],
+			bench_sizes[i] <= PUBSUB_INLINE_MAX ? "inline" : "buffer",
+			ticks / BENCH_MSGS);
+	}
+}
+
+/* Stress run state - next sequence number expected from each publisher */
+struct bench_seqmsg {
+	uint32 pub;
+	uint32 seq;
+};
+uint32 bench_expect[BENCH_STRESS_PUBS];
+uint32 bench_stress_recv = 0;
+uint32 bench_stress_errors = 0;
+
+/*-------------------------------------------------------------------------------
+ * bench_stress_callback - check publications of every publisher arrive in order
+ *--------------------------------------------------------------------------------
+ */
+void bench_stress_callback(topic16 topic, void *data, uint32 size)
+{
+	struct bench_seqmsg msg;
+
+	if(size != sizeof(struct bench_seqmsg)) {
+		bench_stress_errors++;
+		return;
+	}
+	memcpy(&msg, data, sizeof(struct bench_seqmsg));
+	if(msg.pub >= BENCH_STRESS_PUBS || msg.seq != bench_expect[msg.pub]) {
+		bench_stress_errors++;
+	} else {
+		bench_expect[msg.pub]++;
+	}
+	bench_stress_recv++;
+}
+
+/*------------------------------------------------------------------------------------
+ * bench_stress_pub - publish numbered messages and report to main when done
+ *------------------------------------------------------------------------------------
+ */
+process bench_stress_pub(pid32 parent, uint32 pub)
+{
+	struct bench_seqmsg msg;
+	uint32 i = 0;
+
+	msg.pub = pub;
+	for(i = 0; i < BENCH_STRESS_MSGS; i++) {
+		msg.seq = i;
+		while(publish(BENCH_STRESS_TOPIC, (void *) &msg, sizeof(msg)) == SYSERR) {
+			yield();
+		}
+	}
+	send(parent, OK);
+	return OK;
+}
+
+/*------------------------------------------------------------------------------------
+ * bench_stress - npubs concurrent publishers, reports publish throughput and checks
+ *                every message is delivered once and in per-publisher order
+ *------------------------------------------------------------------------------------
+ */
+void bench_stress(uint32 npubs)
+{
+	uint32 start;
+	uint32 ticks;
+	uint32 i = 0;
+
+	for(i = 0; i < BENCH_STRESS_PUBS; i++) {
+		bench_expect[i] = 0;
+	}
+	bench_stress_recv = 0;
+	bench_stress_errors = 0;
+
+	resched_cntl(DEFER_START);
+	for(i = 0; i < npubs; i++) {
+		resume(create(bench_stress_pub, 4096, 50, "bench_spub", 2, getpid(), i));
+	}
+	start = getticks();
+	resched_cntl(DEFER_STOP);
+	for(i = 0; i < npubs; i++) {
+		receive();
+	}
+	ticks = getticks() - start;
+	// let broker drain the queue
+	while(bench_stress_recv + bench_stress_errors < npubs * BENCH_STRESS_MSGS) {
+		sleepms(10);
+	}
+
+	bench_report("bench stress: %d publishers %d msgs %d ticks/publish errors=%d %s\n",
+		npubs, npubs * BENCH_STRESS_MSGS, ticks / (npubs * BENCH_STRESS_MSGS),
+		bench_stress_errors, bench_stress_errors == 0 ? "PASS" : "FAIL");
+}
+
+/* Shard run state - deliveries completed by the blocking handler */
+uint32 bench_shard_recv = 0;
+
+/*-------------------------------------------------------------------------------
+ * bench_shard_callback - handler which blocks like one waiting on a device
+ *--------------------------------------------------------------------------------
+ */
+void bench_shard_callback(topic16 topic, void *data, uint32 size)
+{
+	sleepms(BENCH_SHARD_WORK_MS);
+	__sync_fetch_and_add(&bench_shard_recv, 1);
+}
+
+/*------------------------------------------------------------------------------------
+ * bench_shards - ticks to deliver BENCH_SHARD_MSGS publications on each shard run
+ *                topic with topics routed over nshards brokers
+ *------------------------------------------------------------------------------------
+ */
+void bench_shards(uint32 nshards)
+{
+	uint32 start;
+	uint32 ticks;
+	int32 i = 0, j = 0;
+	uint32 seq;
+
+	bench_shard_recv = 0;
+	start = getticks();
+	for(j = 0; j < BENCH_SHARD_MSGS; j++) {
+		for(i = 0; i < BENCH_SHARD_TOPICS; i++) {
+			seq = j;
+			publish(BENCH_SHARD_TOPIC + i, (void *) &seq, sizeof(uint32));
+		}
+	}
+	while(bench_shard_recv < BENCH_SHARD_TOPICS * BENCH_SHARD_MSGS) {
+		sleepms(1);
+	}
+	ticks = getticks() - start;
+
+	bench_report("bench shards: %d shards %d msgs %d ticks\n",
+		nshards, BENCH_SHARD_TOPICS * BENCH_SHARD_MSGS, ticks);
+}
+
+/* Priority run state - deliveries of both priority run topics */
+uint32 bench_prio_recv = 0;
+
+/*-------------------------------------------------------------------------------
+ * bench_prio_callback - handler slow enough for the queues to fill up
+ *--------------------------------------------------------------------------------
+ */
+void bench_prio_callback(topic16 topic, void *data, uint32 size)
+{
+	sleepms(1);
+	bench_prio_recv++;
+}
+
+/*------------------------------------------------------------------------------------
+ * bench_prio - average ticks bulk and control publications wait in the queue while
+ *              bulk traffic keeps the broker busy, drained in the given mode
+ *------------------------------------------------------------------------------------
+ */
+void bench_prio(uint32 mode, const uint32 *weights, char *name)
+{
+	struct pubsubstats before, after;
+	uint32 total = BENCH_PRIO_MSGS + BENCH_PRIO_MSGS / 10;
+	uint32 taken;
+	int32 i = 0;
+
+	pubsub_setdrain(mode, weights);
+	pubsub_getstats(&before);
+	bench_prio_recv = 0;
+	for(i = 0; i < BENCH_PRIO_MSGS; i++) {
+		publish(BENCH_BULK_TOPIC, (void *) &i, sizeof(int32));
+		if(i % 10 == 0) {
+			publish(BENCH_CTRL_TOPIC, (void *) &i, sizeof(int32));
+		}
+	}
+	while(bench_prio_recv < total) {
+		sleepms(10);
+	}
+	pubsub_getstats(&after);
+
+	for(i = 0; i < PSPRIO_CLASSES; i++) {
+		taken = after.prio_taken[i] - before.prio_taken[i];
+		if(taken > 0) {
+			bench_report("bench prio: %s class %d %d msgs avg wait %d ticks\n", name, i,
+				taken, (after.prio_wait[i] - before.prio_wait[i]) / taken);
+		}
+	}
+}
+
+/*------------------------------------------------------------------------------------
+ * bench_mbox - latency of a fast topic sharing the broker with a slow topic whose
+ *              handler runs in the broker or in the subscriber's own process
+ *------------------------------------------------------------------------------------
+ */
+void bench_mbox(bool8 mbox, char *name)
+{
+	pid32 pid;
+	uint32 stamp;
+	int32 i = 0;
+
+	pid = bench_spawn(BENCH_SLOW_TOPIC, 1, &bench_shard_callback, mbox, NULL, NULL);
+
+	bench_delivered = 0;
+	bench_lat_sum = 0;
+	bench_lat_min = 0xFFFFFFFF;
+	bench_lat_max = 0;
+	bench_shard_recv = 0;
+	for(i = 0; i < BENCH_MBOX_MSGS; i++) {
+		publish(BENCH_SLOW_TOPIC, (void *) &i, sizeof(int32));
+		stamp = getticks();
+		publish(BENCH_FAST_TOPIC, (void *) &stamp, sizeof(uint32));
+	}
+	while(bench_delivered < BENCH_MBOX_MSGS || bench_shard_recv < BENCH_MBOX_MSGS) {
+		sleepms(10);
+	}
+	kill(pid);
+
+	bench_report("bench mbox: %s fast topic avg=%d max=%d ticks\n", name,
+		bench_lat_sum / bench_delivered, bench_lat_max);
+}
+
+/* Retain run state - payloads handed to the late subscriber */
+uint32 bench_retain_recv = 0;
+
+/*-------------------------------------------------------------------------------
+ * bench_retain_callback - count retained payloads of the late subscriber
+ *--------------------------------------------------------------------------------
+ */
+void bench_retain_callback(topic16 topic, void *data, uint32 size)
+{
+	bench_retain_recv++;
+}
+
+/*------------------------------------------------------------------------------------
+ * bench_retain - ticks until a late subscriber has the retained payloads of a topic
+ *                published to before it subscribed
+ *------------------------------------------------------------------------------------
+ */
+void bench_retain(uint32 depth)
+{
+	uint32 start;
+	uint32 ticks;
+	int32 i = 0;
+
+	pubsub_setretain(BENCH_RETAIN_TOPIC, depth);
+	for(i = 0; i < PSRETAIN_MAX + 2; i++) {
+		publish(BENCH_RETAIN_TOPIC, (void *) &i, sizeof(int32));
+	}
+	// let broker take them
+	sleepms(50);
+
+	bench_retain_recv = 0;
+	start = getticks();
+	subscribe(BENCH_RETAIN_TOPIC, &bench_retain_callback);
+	// broker hands them over in queue order
+	while(bench_retain_recv < depth) {
+		sleepms(1);
+	}
+	ticks = getticks() - start;
+	unsubscribe(BENCH_RETAIN_TOPIC);
+	pubsub_setretain(BENCH_RETAIN_TOPIC, 0);
+
+	bench_report("bench retain: depth %d late subscriber got %d payloads in %d ticks\n",
+		depth, bench_retain_recv, ticks);
+}
+
+/* Conflation run state - samples handled and the newest one seen */
+uint32 bench_conflate_recv = 0;
+int32 bench_conflate_last = 0;
+
+/*-------------------------------------------------------------------------------
+ * bench_conflate_callback - slow sensor sample handler
+ *--------------------------------------------------------------------------------
+ */
+void bench_conflate_callback(topic16 topic, void *data, uint32 size)
+{
+	memcpy(&bench_conflate_last, data, sizeof(int32));
+	bench_conflate_recv++;
+	sleepms(1);
+}
+
+/*------------------------------------------------------------------------------------
+ * bench_conflate - samples a slow handler processes for a burst of BENCH_MSGS
+ *                  publications, with conflation of the topic on or off
+ *------------------------------------------------------------------------------------
+ */
+void bench_conflate(bool8 on)
+{
+	struct pubsubstats before, after;
+	int32 i = 0;
+
+	pubsub_setconflate(BENCH_CONFLATE_TOPIC, on);
+	subscribe(BENCH_CONFLATE_TOPIC, &bench_conflate_callback);
+	pubsub_getstats(&before);
+	bench_conflate_recv = 0;
+	bench_conflate_last = -1;
+	for(i = 0; i < BENCH_MSGS; i++) {
+		publish(BENCH_CONFLATE_TOPIC, (void *) &i, sizeof(int32));
+	}
+	// let broker work through the burst
+	while(bench_conflate_last != BENCH_MSGS - 1) {
+		sleepms(10);
+	}
+	pubsub_getstats(&after);
+	unsubscribe(BENCH_CONFLATE_TOPIC);
+	pubsub_setconflate(BENCH_CONFLATE_TOPIC, FALSE);
+
+	bench_report("bench conflate: %s %d published %d handled %d replaced\n", on ? "on" : "off",
+		BENCH_MSGS, bench_conflate_recv, after.conflated - before.conflated);
+}
+
+/*------------------------------------------------------------------------------------
+ * bench_topic_bytes - memory used by the topic table, the part spent on subscriber
+ *                     vectors in *vecbytes
+ *------------------------------------------------------------------------------------
+ */
+uint32 bench_topic_bytes(uint32 *vecbytes)
+{
+	uint32 bytes = PSTOPIC_SLOTS * sizeof(struct pubsubent *);
+	uint32 i = 0;
+
+	*vecbytes = 0;
+	for(i = 0; i < PSTOPIC_SLOTS; i++) {
+		if(PSTOPIC_LIVE(pstopics[i])) {
+			bytes += sizeof(struct pubsubent);
+			*vecbytes += pstopics[i]->nslots * sizeof(struct pubsubfp);
+		}
+	}
+	return bytes + *vecbytes;
+}
+
+/*------------------------------------------------------------------------------------
+ * bench_topic_memory - print topic table memory next to what entries with
+ *                      BENCH_FIXED_SLOTS embedded subscriber slots would take
+ *------------------------------------------------------------------------------------
+ */
+void bench_topic_memory(char *name)
+{
+	uint32 bytes;
+	uint32 vecbytes;
+
+	bytes = bench_topic_bytes(&vecbytes);
+	bench_report("bench memory %s: %d topics %d bytes (%d in subscriber vectors), %d with %d fixed slots\n",
+		name, pstopic_count, bytes, vecbytes,
+		PSTOPIC_SLOTS * sizeof(struct pubsubent *)
+		+ pstopic_count * (sizeof(struct pubsubent) + BENCH_FIXED_SLOTS * sizeof(struct pubsubfp)),
+		BENCH_FIXED_SLOTS);
+}
+
+/* Wide topic run state - deliveries carrying the expected topic32 */
+uint32 bench_wide_recv = 0;
+
+/*-------------------------------------------------------------------------------
+ * bench_wide_callback - count deliveries of the wide topic
+ *--------------------------------------------------------------------------------
+ */
+void bench_wide_callback(topic32 topic, void *data, uint32 size)
+{
+	if(topic == BENCH_WIDE_TOPIC) {
+		bench_wide_recv++;
+	}
+}
+
+/*------------------------------------------------------------------------------------
+ * bench_wide - ticks per publish() to a topic32 beyond the topic16 range, and the
+ *              memory the topic table uses compared to a flat table of MAX_TOPIC
+ *------------------------------------------------------------------------------------
+ */
+void bench_wide(void)
+{
+	uint32 start;
+	uint32 ticks;
+	int32 i = 0;
+
+	subscribe32(BENCH_WIDE_TOPIC, &bench_wide_callback);
+	bench_wide_recv = 0;
+	start = getticks();
+	for(i = 0; i < BENCH_MSGS; i++) {
+		publish(BENCH_WIDE_TOPIC, (void *) &i, sizeof(int32));
+	}
+	ticks = getticks() - start;
+	while(bench_wide_recv < BENCH_MSGS) {
+		sleepms(10);
+	}
+	unsubscribe(BENCH_WIDE_TOPIC);
+
+	bench_report("bench wide: topic 0x%x %d ticks/publish\n", BENCH_WIDE_TOPIC, ticks / BENCH_MSGS);
+	bench_report("bench topics: %d in use, flat table of %d would take %d bytes\n",
+		pstopic_count, MAX_TOPIC, MAX_TOPIC * sizeof(struct pubsubent));
+	bench_topic_memory("wide");
+}
+
+/* Fan-out run state - deliveries to all subscribers of the fan-out topic */
+uint32 bench_fanout_recv = 0;
+
+/*-------------------------------------------------------------------------------
+ * bench_fanout_callback - count deliveries of the fan-out topic
+ *--------------------------------------------------------------------------------
+ */
+void bench_fanout_callback(topic16 topic, void *data, uint32 size)
+{
+	__sync_fetch_and_add(&bench_fanout_recv, 1);
+}
+
+/*------------------------------------------------------------------------------------
+ * bench_fanout - ticks to deliver BENCH_MSGS publications to BENCH_FANOUT_SUBS
+ *                subscribers of one topic, topic table memory with them subscribed
+ *                and after they are killed
+ *------------------------------------------------------------------------------------
+ */
+void bench_fanout(void)
+{
+	pid32 pids[BENCH_FANOUT_SUBS];
+	status result;
+	int32 npids = 0;
+	uint32 nsubs = 0;
+	uint32 start;
+	uint32 ticks;
+	int32 i = 0;
+
+	for(npids = 0; npids < BENCH_FANOUT_SUBS; npids++) {
+		pids[npids] = bench_spawn(BENCH_FANOUT_TOPIC, 1, &bench_fanout_callback, FALSE, NULL,
+			&result);
+		if(pids[npids] == SYSERR) {
+			break;
+		}
+		if(result == OK) {
+			nsubs++;
+		}
+	}
+	bench_topic_memory("subscribed");
+
+	bench_fanout_recv = 0;
+	start = getticks();
+	for(i = 0; i < BENCH_MSGS; i++) {
+		publish(BENCH_FANOUT_TOPIC, (void *) &i, sizeof(int32));
+	}
+	while(bench_fanout_recv < nsubs * BENCH_MSGS) {
+		sleepms(10);
+	}
+	ticks = getticks() - start;
+
+	bench_report("bench fanout: %d subscribers %d deliveries %d ticks\n", nsubs, bench_fanout_recv, ticks);
+
+	for(i = 0; i < npids; i++) {
+		kill(pids[i]);
+	}
+	bench_topic_memory("unsubscribed");
+}
+
+/* Wildcard run state - deliveries to the matching filters */
+uint32 bench_trie_recv = 0;
+
+/*-------------------------------------------------------------------------------
+ * bench_trie_callback - count deliveries of the wildcard run path
+ *--------------------------------------------------------------------------------
+ */
+void bench_trie_callback(topic32 topic, void *data, uint32 size)
+{
+	char *path = pubsub_path(topic);
+
+	if(path != NULL && strcmp(path, BENCH_TRIE_PATH) == 0) {
+		bench_trie_recv++;
+	}
+}
+
+/*------------------------------------------------------------------------------------
+ * bench_trie - ticks per publish_path() to a path matched by sensors/+/temp and
+ *              sensors/#, next to nothers filters in unrelated subtrees
+ *------------------------------------------------------------------------------------
+ */
+void bench_trie(int32 nothers)
+{
+	char filter[PSTRIE_NAMELEN * 3];
+	uint32 start;
+	uint32 ticks;
+	int32 i = 0;
+
+	for(i = 0; i < nothers; i++) {
+		sprintf(filter, "zone%d/+/temp", i);
+		subscribe_path(filter, &bench_trie_callback);
+	}
+	subscribe_path("sensors/+/temp", &bench_trie_callback);
+	subscribe_path("sensors/#", &bench_trie_callback);
+
+	bench_trie_recv = 0;
+	start = getticks();
+	for(i = 0; i < BENCH_MSGS; i++) {
+		publish_path(BENCH_TRIE_PATH, (void *) &i, sizeof(int32));
+	}
+	ticks = getticks() - start;
+	while(bench_trie_recv < 2 * BENCH_MSGS) {
+		sleepms(10);
+	}
+
+	unsubscribe_path("sensors/+/temp");
+	unsubscribe_path("sensors/#");
+	for(i = 0; i < nothers; i++) {
+		sprintf(filter, "zone%d/+/temp", i);
+		unsubscribe_path(filter);
+	}
+
+	bench_report("bench wildcard: %d other filters %d ticks/publish %d deliveries\n",
+		nothers, ticks / BENCH_MSGS, bench_trie_recv);
+}
+
+/* Content filter run state - publications handlers accepted */
+uint32 bench_filter_recv = 0;
+
+/*-------------------------------------------------------------------------------
+ * bench_filter_check - handler testing the payload itself
+ *--------------------------------------------------------------------------------
+ */
+void bench_filter_check(topic16 topic, void *data, uint32 size)
+{
+	if(((uint8 *) data)[0] != 0) {
+		return;
+	}
+	__sync_fetch_and_add(&bench_filter_recv, 1);
+}
+
+/*-------------------------------------------------------------------------------
+ * bench_filter_callback - handler behind a content filter
+ *--------------------------------------------------------------------------------
+ */
+void bench_filter_callback(topic16 topic, void *data, uint32 size)
+{
+	__sync_fetch_and_add(&bench_filter_recv, 1);
+}
+
+/*------------------------------------------------------------------------------------
+ * bench_filter - ticks to deliver BENCH_MSGS publications to BENCH_FILTER_SUBS
+ *                selective subscribers, filtering in handlers or in the broker
+ *------------------------------------------------------------------------------------
+ */
+void bench_filter(bool8 filtered, char *name)
+{
+	pid32 pids[BENCH_FILTER_SUBS];
+	struct psfilter filter;
+	struct pubsubstats before, after;
+	uint8 value;
+	uint32 want = 0;
+	uint32 start;
+	uint32 ticks;
+	int32 i = 0;
+
+	// payload byte 0 must be 0
+	filter.op = PSF_RANGE;
+	filter.offset = 0;
+	filter.width = 1;
+	filter.a = 0;
+	filter.b = 0;
+	for(i = 0; i < BENCH_FILTER_SUBS; i++) {
+		if(filtered) {
+			pids[i] = bench_spawn(BENCH_FILTER_TOPIC, 1, &bench_filter_callback, FALSE, &filter,
+				NULL);
+		} else {
+			pids[i] = bench_spawn(BENCH_FILTER_TOPIC, 1, &bench_filter_check, FALSE, NULL, NULL);
+		}
+	}
+
+	pubsub_getstats(&before);
+	bench_filter_recv = 0;
+	start = getticks();
+	// last publication is wanted, so it being handled means the run is over
+	for(i = BENCH_MSGS - 1; i >= 0; i--) {
+		value = i % BENCH_FILTER_EVERY;
+		if(value == 0) {
+			want += BENCH_FILTER_SUBS;
+		}
+		publish(BENCH_FILTER_TOPIC, (void *) &value, sizeof(uint8));
+	}
+	while(bench_filter_recv < want) {
+		sleepms(1);
+	}
+	ticks = getticks() - start;
+	pubsub_getstats(&after);
+
+	for(i = 0; i < BENCH_FILTER_SUBS; i++) {
+		kill(pids[i]);
+	}
+
+	bench_report("bench filter %s: %d subscribers %d wanted %d ticks, %d skipped by broker\n",
+		name, BENCH_FILTER_SUBS, want, ticks, after.filtered - before.filtered);
+}
+
+/* Streaming run state - payloads received whole and reassembly of chunks */
+uint32 bench_stream_recv = 0;
+bool8 bench_stream_chunked = FALSE;
+struct psreasm bench_reasm;
+char bench_stream_buf[BENCH_STREAM_SIZE];
+
+/*-------------------------------------------------------------------------------
+ * bench_stream_callback - count whole payloads, reassembling streamed chunks
+ *--------------------------------------------------------------------------------
+ */
+void bench_stream_callback(topic16 topic, void *data, uint32 size)
+{
+	uint32 total = size;
+
+	if(bench_stream_chunked) {
+		data = pstream_reasm(&bench_reasm, data, size, &total);
+		if(data == NULL) {
+			return;
+		}
+	}
+	if(total == BENCH_STREAM_SIZE) {
+		bench_stream_recv++;
+	}
+}
+
+/*------------------------------------------------------------------------------------
+ * bench_stream - ticks to deliver BENCH_STREAM_MSGS payloads of BENCH_STREAM_SIZE
+ *                bytes whole with publish() or in chunks with publish_stream(),
+ *                and the memory queued payloads may take
+ *------------------------------------------------------------------------------------
+ */
+void bench_stream(bool8 chunked)
+{
+	struct pubsubstats before, after;
+	uint32 start;
+	uint32 ticks;
+	int32 i = 0;
+
+	bench_stream_chunked = chunked;
+	bench_stream_recv = 0;
+	pstream_init(&bench_reasm);
+	subscribe(BENCH_STREAM_TOPIC, &bench_stream_callback);
+
+	pubsub_getstats(&before);
+	start = getticks();
+	for(i = 0; i < BENCH_STREAM_MSGS; i++) {
+		bench_stream_buf[0] = i;
+		if(chunked) {
+			publish_stream(BENCH_STREAM_TOPIC, bench_stream_buf, BENCH_STREAM_SIZE);
+		} else {
+			publish(BENCH_STREAM_TOPIC, bench_stream_buf, BENCH_STREAM_SIZE);
+		}
+	}
+	while(bench_stream_recv < BENCH_STREAM_MSGS) {
+		sleepms(10);
+	}
+	ticks = getticks() - start;
+	pubsub_getstats(&after);
+	unsubscribe(BENCH_STREAM_TOPIC);
+	pstream_reset(&bench_reasm);
+
+	if(chunked) {
+		bench_report("bench stream chunked: %d x %d bytes %d ticks, %d chunks, at most %d bytes queued\n",
+			BENCH_STREAM_MSGS, BENCH_STREAM_SIZE, ticks, after.chunks - before.chunks,
+			PSCHUNK_NBUFS * (sizeof(struct pubbuf) + sizeof(struct pschunk) + PSCHUNK_SIZE));
+	} else {
+		bench_report("bench stream whole: %d x %d bytes %d ticks, %d heap blocks, up to %d bytes queued\n",
+			BENCH_STREAM_MSGS, BENCH_STREAM_SIZE, ticks, after.heap_allocs - before.heap_allocs,
+			BENCH_STREAM_MSGS * (sizeof(struct pubbuf) + BENCH_STREAM_SIZE));
+	}
+}
+
+/* Batch publish run state - messages delivered and the batch */
+uint32 bench_pubv_recv = 0;
+struct pubmsg bench_pubv_msgs[BENCH_PUBV_MSGS];
+uint32 bench_pubv_vals[BENCH_PUBV_MSGS];
+
+/*-------------------------------------------------------------------------------
+ * bench_pubv_callback - count messages of the batch publish run
+ *--------------------------------------------------------------------------------
+ */
+void bench_pubv_callback(topic16 topic, void *data, uint32 size)
+{
+	bench_pubv_recv++;
+}
+
+/*------------------------------------------------------------------------------------
+ * bench_pubv - ticks to publish and deliver BENCH_PUBV_ROUNDS batches of
+ *              BENCH_PUBV_MSGS small messages with a publish() per message or with
+ *              one publishv() per batch
+ *------------------------------------------------------------------------------------
+ */
+void bench_pubv(bool8 batch)
+{
+	uint32 start;
+	uint32 pubticks = 0;
+	uint32 ticks;
+	uint32 accepted = 0;
+	int32 i = 0, j = 0;
+
+	for(j = 0; j < BENCH_PUBV_MSGS; j++) {
+		bench_pubv_vals[j] = j;
+		bench_pubv_msgs[j].topic = BENCH_PUBV_TOPIC;
+		bench_pubv_msgs[j].data = &bench_pubv_vals[j];
+		bench_pubv_msgs[j].size = sizeof(uint32);
+	}
+	bench_pubv_recv = 0;
+	subscribe(BENCH_PUBV_TOPIC, &bench_pubv_callback);
+
+	start = getticks();
+	for(i = 0; i < BENCH_PUBV_ROUNDS; i++) {
+		ticks = getticks();
+		if(batch) {
+			accepted += publishv(bench_pubv_msgs, BENCH_PUBV_MSGS);
+		} else {
+			for(j = 0; j < BENCH_PUBV_MSGS; j++) {
+				if(publish(BENCH_PUBV_TOPIC, &bench_pubv_vals[j], sizeof(uint32)) == OK) {
+					accepted++;
+				}
+			}
+		}
+		pubticks += getticks() - ticks;
+	}
+	while(bench_pubv_recv < accepted) {
+		sleepms(1);
+	}
+	ticks = getticks() - start;
+	unsubscribe(BENCH_PUBV_TOPIC);
+
+	bench_report("bench %s: %d x %d msgs, %d accepted, %d ticks publishing, %d ticks delivered\n",
+		batch ? "publishv" : "publish", BENCH_PUBV_ROUNDS, BENCH_PUBV_MSGS, accepted,
+		pubticks, ticks);
+}
+
+/*------------------------------------------------------------------------------------
+ * bench_kill - ticks spent in kill() for a process with ntopics subscriptions while
+ *              every other topic also has a subscriber
+ *------------------------------------------------------------------------------------
+ */
+void bench_kill(int32 ntopics)
+{
+	pid32 pid;
+	uint32 start;
+	uint32 ticks;
+
+	pid = bench_spawn(0x0100, ntopics, &bench_callback, FALSE, NULL, NULL);
+
+	start = getticks();
+	kill(pid);
+	ticks = getticks() - start;
+
+	bench_report("bench kill: %d subscriptions %d ticks\n", ntopics, ticks);
+}
+
+/*------------------------------------------------------------------------------------
+ * main - pubsub benchmark, build with PSTRACE_LEVEL set to PSTRACE_OFF to measure
+ *        pubsub without the trace log
+ *
+ * # Idle CPU : iterations a priority 10 process completes in BENCH_IDLE_MS
+ *              while the broker has nothing to do
+ * # Latency  : ticks from publish() to the subscriber handler
+ * # Batching : average entries broker drained per critical section
+ * # Throughput : ticks per publish() for payload sizes around PUBSUB_INLINE_MAX
+ * # Stress   : 1..BENCH_STRESS_PUBS concurrent publishers, throughput and ordering
+ * # Shards   : delivery time with blocking handlers for 1..PUBSUB_SHARDS shards
+ * # Priority : queue wait of control and bulk publications, strict and weighted
+ * # Mailbox  : fast topic latency next to a slow handler in broker or mailbox mode
+ * # Retain   : payloads a late subscriber starts with, depth 1 and PSRETAIN_MAX
+ * # Conflate : samples handled for a burst with conflation off and on
+ * # Wide     : publish() to a topic32 and topic table memory
+ * # Fan-out  : BENCH_FANOUT_SUBS subscribers of one topic, topic table memory
+ *              compared to BENCH_FIXED_SLOTS embedded subscriber slots
+ * # Filter   : BENCH_FILTER_SUBS subscribers wanting 1 in BENCH_FILTER_EVERY
+ *              publications, tested in the handler and by a content filter
+ * # Stream   : BENCH_STREAM_SIZE byte payloads published whole and in chunks
+ *              that the subscriber reassembles
+ * # Batch    : BENCH_PUBV_MSGS small messages by publish() each and by publishv()
+ * # Wildcard : publish_path() to two matching filters, alone and beside
+ *              BENCH_TRIE_OTHERS filters of other subtrees
+ * # Kill     : kill() latency for processes with 1 and BENCH_KILL_TOPICS topics
+ *------------------------------------------------------------------------------------
+ */
+process	main(void)
+{
+	pid32 idle_id;
+	pid32 pid;
+	status result;
+	struct pubsubstats stats;
+	uint32 n = 0;
+	uint32 weights[PSPRIO_CLASSES] = { 4, 2, 1 };
+
+	recvclr();
+
+	// idle CPU with an empty publishing queue
+	bench_running = 1;
+	bench_idle_count = 0;
+	idle_id = create(bench_idle, 4096, 10, "bench_idle", 0);
+	resume(idle_id);
+	sleepms(BENCH_IDLE_MS);
+	bench_running = 0;
+	sleepms(10);
+
+	bench_report("bench idle: %d iterations in %d ms\n", bench_idle_count, BENCH_IDLE_MS);
+
+	// publish-to-handler latency
+	pid = bench_spawn(BENCH_TOPIC, 1, &bench_callback, FALSE, NULL, &result);
+	if(result == SYSERR) {
+		bench_report("bench latency: subscribing to topic 0x%x failed\n", BENCH_TOPIC);
+	}
+	resume(create(bench_publisher, 4096, 50, "bench_pub", 0));
+	sleepms(BENCH_MSGS * 2 + 500);
+	kill(pid);
+	pubsub_getstats(&stats);
+
+	if(bench_delivered > 0) {
+		bench_report("bench latency: %d msgs min=%d avg=%d max=%d ticks\n",
+			bench_delivered, bench_lat_min,
+			bench_lat_sum / bench_delivered, bench_lat_max);
+	} else {
+		bench_report("bench latency: no publications delivered\n");
+	}
+	if(stats.batches > 0) {
+		bench_report("bench batching: %d entries in %d batches, avg %d.%02d\n",
+			stats.batched, stats.batches, stats.batched / stats.batches,
+			(stats.batched % stats.batches) * 100 / stats.batches);
+	}
+
+	bench_throughput();
+
+	// concurrent publishers, queue blocks rather than dropping
+	pubsub_setlimit(PUBQ_RING_SIZE, PSQ_BLOCK);
+	bench_spawn(BENCH_STRESS_TOPIC, 1, &bench_stress_callback, FALSE, NULL, NULL);
+	bench_stress(1);
+	bench_stress(2);
+	bench_stress(4);
+	bench_stress(BENCH_STRESS_PUBS);
+
+	// same load routed over a growing number of brokers
+	bench_spawn(BENCH_SHARD_TOPIC, BENCH_SHARD_TOPICS, &bench_shard_callback, FALSE, NULL, NULL);
+	for(n = 1; pubsub_setshards(n) == OK; n <<= 1) {
+		bench_shards(n);
+	}
+	pubsub_setshards(PUBSUB_SHARDS);
+
+	// control messages behind bulk traffic on one broker
+	pubsub_setshards(1);
+	pubsub_settopicprio(BENCH_BULK_TOPIC, PSPRIO_BULK);
+	pubsub_settopicprio(BENCH_CTRL_TOPIC, PSPRIO_HIGH);
+	// control topic follows the bulk topic
+	bench_spawn(BENCH_BULK_TOPIC, 2, &bench_prio_callback, FALSE, NULL, NULL);
+	bench_prio(PSDRAIN_STRICT, NULL, "strict");
+	bench_prio(PSDRAIN_WEIGHTED, weights, "weighted");
+	pubsub_setdrain(PSDRAIN_STRICT, NULL);
+
+	// slow handler on the same broker as a fast topic
+	subscribe(BENCH_FAST_TOPIC, &bench_callback);
+	bench_mbox(FALSE, "broker");
+	bench_mbox(TRUE, "mailbox");
+	unsubscribe(BENCH_FAST_TOPIC);
+	pubsub_setshards(PUBSUB_SHARDS);
+
+	// late subscriber of a topic with retained payloads
+	bench_retain(1);
+	bench_retain(PSRETAIN_MAX);
+
+	// burst of sensor samples to a slow handler
+	bench_conflate(FALSE);
+	bench_conflate(TRUE);
+
+	bench_wide();
+	bench_fanout();
+
+	// selective subscribers, payload tested by handler then by broker
+	bench_filter(FALSE, "handler");
+	bench_filter(TRUE, "broker");
+
+	// large payloads, whole heap blocks and pool chunks
+	bench_stream(FALSE);
+	bench_stream(TRUE);
+
+	// small messages one call each or one call per batch
+	bench_pubv(FALSE);
+	bench_pubv(TRUE);
+
+	// hierarchical filters, cost should not grow with unrelated filters
+	bench_trie(0);
+	bench_trie(BENCH_TRIE_OTHERS);
+
+	// background subscriber on every topic so the topic table is populated
+	bench_spawn(0x0100, MAX_TOPIC, &bench_callback, FALSE, NULL, NULL);
+	bench_kill(1);
+	bench_kill(BENCH_KILL_TOPICS);
+
+	return OK;
+}
@@ -600,9 +600,62 @@ extern	syscall	yield(void);
 #define	ntohl(x)   (  (((x)>>24) & 0x000000ff) | (((x)>> 8) & 0x0000ff00) | \
 		      (((x)<< 8) & 0x00ff0000) | (((x)<<24) & 0xff000000) )
 
+/* in file pubring.c */
+extern status pubq_init(struct pubqueue *, uint32);
+extern struct publishqueue *pubq_reserve(struct pubqueue *, uint32 *);
+extern uint32 pubq_reserven(struct pubqueue *, uint32, uint32 *);
+extern void pubq_commit(struct pubqueue *, struct publishqueue *, uint32);
+extern struct publishqueue *pubq_take(struct pubqueue *, uint32 *);
+extern void pubq_release(struct pubqueue *, struct publishqueue *, uint32);
+extern uint32 pubq_count(struct pubqueue *);
+
+/* in file pubtrie.c */
+extern status pstrie_insert(struct pstnode *, char *, struct pstsub *);
+extern void pstrie_remove(struct pstsub *);
+extern struct pstsub *pstrie_find(struct pstnode *, char *, pid32);
+extern uint32 pstrie_match(struct pstnode *, char *, struct pstsub **, uint32);
+
+/* in file pubtrace.c */
+extern status pstrace_init(void);
+extern void pstrace_put(uint32, topic32, char *, uint32);
+extern process pstrace_logger(void);
+
 /* in file pubsub.c */
-extern syscall subscribe(topic16, void (*handler)(topic16, void *, uint32));
-extern syscall unsubscribe(topic16);
-extern syscall publish(topic16, void *, uint32);
-extern syscall pubsub_init();
+extern syscall subscribe(topic32, void (*handler)(topic16, void *, uint32));
+extern syscall subscribe_mbox(topic32, void (*handler)(topic16, void *, uint32));
+extern syscall subscribe32(topic32, void (*handler)(topic32, void *, uint32));
+extern syscall subscribe32_mbox(topic32, void (*handler)(topic32, void *, uint32));
+extern syscall subscribe_filter(topic32, void (*handler)(topic16, void *, uint32), const struct psfilter *);
+extern syscall subscribe32_filter(topic32, void (*handler)(topic32, void *, uint32), const struct psfilter *);
+extern syscall subscribe_path(char *, void (*handler)(topic32, void *, uint32));
+extern syscall pubsub_receive(void);
+extern syscall unsubscribe(topic32);
+extern syscall unsubscribe_path(char *);
+extern syscall publish(topic32, void *, uint32);
+extern syscall publish_buf(topic32, char *);
+extern syscall publishv(struct pubmsg *, uint32);
+extern syscall publish_path(char *, void *, uint32);
+extern syscall publish_stream(topic32, void *, uint32);
+extern void pstream_init(struct psreasm *);
+extern char *pstream_reasm(struct psreasm *, void *, uint32, uint32 *);
+extern void pstream_reset(struct psreasm *);
+extern char *pubsub_path(topic32);
+extern char *pubbuf_alloc(uint32);
+extern syscall pubbuf_hold(char *);
+extern syscall pubbuf_release(char *);
+extern syscall pubsub_init(uint32);
 extern syscall unsubscribe_pub_sub(pid32);
+extern syscall pubsub_setbatch(uint32);
+extern syscall pubsub_setlimit(uint32, uint32);
+extern syscall pubsub_setshards(uint32);
+extern syscall pubsub_settopiclimit(topic32, uint32, uint32);
+extern syscall pubsub_settopicprio(topic32, uint32);
+extern syscall pubsub_setdrain(uint32, const uint32 *);
+extern syscall pubsub_setconflate(topic32, bool8);
+extern syscall pubsub_setretain(topic32, uint32);
+extern syscall pubsub_getstats(struct pubsubstats *);
+extern syscall pubsub_topicstats(topic32, struct pstopicstats *);
+extern uint32 pubsub_topics(topic32 *, uint32);
+
+/* in file xsh_pubsub.c */
+extern shellcmd xsh_pubsub(int32, char *[]);
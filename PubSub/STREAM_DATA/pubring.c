@@ -0,0 +1,162 @@
+/* pubring.c - pubq_init, pubq_reserve, pubq_reserven, pubq_commit, pubq_take, pubq_release */
+#include <xinu.h>
+
+/*-------------------------------------------------------------------------
+ * Lock-free publishing queue
+ *
+ * Bounded ring of publishqueue entries. Every entry carries a sequence
+ * number telling which ring position it may be used for next:
+ *   seq == pos          - free, a publisher may reserve position pos
+ *   seq == pos + 1      - filled, the broker may take position pos
+ * Publishers reserve positions with a compare-and-swap on tail and the
+ * consumer side takes them with a compare-and-swap on head, so neither
+ * side ever waits on a semaphore. Position counters wrap modulo 2^32.
+ *--------------------------------------------------------------------------
+ */
+
+/*-------------------------------------------------------------------------
+ * pubq_init - allocate a ring of size entries, size is a power of 2
+ *--------------------------------------------------------------------------
+ */
+status pubq_init(struct pubqueue *q, uint32 size)
+{
+	uint32 i = 0;
+
+	if(size == 0 || (size & (size - 1)) != 0) {
+		return SYSERR;
+	}
+	q->ring = (struct publishqueue *) getmem(size * sizeof(struct publishqueue));
+	if(q->ring == (struct publishqueue *) SYSERR) {
+		return SYSERR;
+	}
+	for(i = 0; i < size; i++) {
+		q->ring[i].seq = i;
+		q->ring[i].data = NULL;
+		q->ring[i].size = 0;
+	}
+	q->mask = size - 1;
+	q->head = 0;
+	q->tail = 0;
+	return OK;
+}
+
+/*-------------------------------------------------------------------------
+ * pubq_reserve - reserve the next free entry, NULL when the ring is full.
+ *                The caller fills the entry and hands it to pubq_commit().
+ *--------------------------------------------------------------------------
+ */
+struct publishqueue *pubq_reserve(struct pubqueue *q, uint32 *pos)
+{
+	struct publishqueue *ent;
+	uint32 tail;
+	int32 dif;
+
+	tail = q->tail;
+	while(1) {
+		ent = &q->ring[tail & q->mask];
+		dif = (int32) (ent->seq - tail);
+		if(dif == 0) {
+			if(__sync_bool_compare_and_swap(&q->tail, tail, tail + 1)) {
+				*pos = tail;
+				return ent;
+			}
+		} else if(dif < 0) {
+			// entry still holds a publication from the previous lap
+			return NULL;
+		}
+		tail = q->tail;
+	}
+}
+
+/*-------------------------------------------------------------------------
+ * pubq_reserven - reserve up to n consecutive free entries with a single
+ *                 compare-and-swap, returns the number reserved, 0 when
+ *                 the ring is full. Entry i of the run is at position
+ *                 *pos + i, each is handed to pubq_commit() on its own.
+ *--------------------------------------------------------------------------
+ */
+uint32 pubq_reserven(struct pubqueue *q, uint32 n, uint32 *pos)
+{
+	uint32 tail;
+	uint32 k;
+	int32 dif = 0;
+
+	tail = q->tail;
+	while(1) {
+		for(k = 0; k < n; k++) {
+			dif = (int32) (q->ring[(tail + k) & q->mask].seq - (tail + k));
+			if(dif != 0) {
+				break;
+			}
+		}
+		if(k > 0) {
+			if(__sync_bool_compare_and_swap(&q->tail, tail, tail + k)) {
+				*pos = tail;
+				return k;
+			}
+		} else if(dif < 0) {
+			// entry at tail still holds a publication from the previous lap
+			return 0;
+		}
+		tail = q->tail;
+	}
+}
+
+/*-------------------------------------------------------------------------
+ * pubq_commit - make a filled entry visible to the consumer
+ *--------------------------------------------------------------------------
+ */
+void pubq_commit(struct pubqueue *q, struct publishqueue *ent, uint32 pos)
+{
+	// entry contents must be visible before its sequence number
+	__sync_synchronize();
+	ent->seq = pos + 1;
+}
+
+/*-------------------------------------------------------------------------
+ * pubq_take - take the oldest filled entry, NULL when the ring is empty.
+ *             The caller copies it out and hands it to pubq_release().
+ *--------------------------------------------------------------------------
+ */
+struct publishqueue *pubq_take(struct pubqueue *q, uint32 *pos)
+{
+	struct publishqueue *ent;
+	uint32 head;
+	int32 dif;
+
+	head = q->head;
+	while(1) {
+		ent = &q->ring[head & q->mask];
+		dif = (int32) (ent->seq - (head + 1));
+		if(dif == 0) {
+			if(__sync_bool_compare_and_swap(&q->head, head, head + 1)) {
+				__sync_synchronize();
+				*pos = head;
+				return ent;
+			}
+		} else if(dif < 0) {
+			// nothing committed at head yet
+			return NULL;
+		}
+		head = q->head;
+	}
+}
+
+/*-------------------------------------------------------------------------
+ * pubq_release - give a taken entry back to publishers for the next lap
+ *--------------------------------------------------------------------------
+ */
+void pubq_release(struct pubqueue *q, struct publishqueue *ent, uint32 pos)
+{
+	__sync_synchronize();
+	ent->seq = pos + q->mask + 1;
+}
+
+/*-------------------------------------------------------------------------
+ * pubq_count - entries reserved and not yet taken, a snapshot only
+ *--------------------------------------------------------------------------
+ */
+uint32 pubq_count(struct pubqueue *q)
+{
+	return q->tail - q->head;
+}
@@ -1,284 +1,3107 @@
 /* pubsub.c - publish, subscribe, unsubscribe, broker */
 #include <xinu.h>
 
-/* topic table */
-struct pubsubent pubsub[MAX_TOPIC];
-/* publishing queue */
-struct pubqueue *publishq;
+/* pubq_put() result when the new publication is discarded */
+#define PUBQ_DISCARD (-4)
+
+/* pubsub counters are updated concurrently by publishers and broker */
+#define PSSTAT_ADD(field, n)	__sync_fetch_and_add(&psstats.field, (n))
+/* per-topic counters updated by publishers */
+#define PSTSTAT_ADD(psent, field, n)	__sync_fetch_and_add(&(psent)->stats.field, (n))
+
+/* topic table - open addressing by topic id. Publishers and brokers look
+   topics up without taking mutex, so an entry reclaimed for having no
+   subscribers, settings or queued entries leaves pstopic_tomb in its slot
+   and is kept for reuse instead of being freed, see pstopic_reclaim() */
+struct pubsubent *pstopics[PSTOPIC_SLOTS];
+uint32 pstopic_count;
+local struct pubsubent pstopic_tomb;
+local struct pubsubent *pstopic_free;
+/* path topics with an entry of their own, at most PSTOPIC_PATHS */
+uint32 pstopic_paths;
+/* publishing shards, each with a lock-free queue (see pubring.c) and a broker */
+struct pubshard *psshard;
+/* shards set up by pubsub_init(), shards topics are currently routed to */
+uint32 psnshards;
+uint32 psroute;
+/* protects topic table - subscribe, unsubscribe and broker delivery lists */
 sid32 mutex;
-/* max entries in publishing queue - dynamic */
-uint32 max_pub_queue;
 sid32 print_mutex;
+/* max entries broker drains per critical section */
+uint32 broker_batch;
+/* capacity of each shard queue and overflow policy for all topics */
+uint32 pubq_limit;
+uint32 pubq_policy;
+/* order broker drains priority classes in, entries per turn for PSDRAIN_WEIGHTED */
+uint32 psdrain;
+uint32 psweight[PSPRIO_CLASSES];
+/* first subscription of each process, see PSREF() */
+int32 pssubs[NPROC];
+/* mailbox of each process id that had PSDLV_MBOX subscriptions, NULL if
+   none - kept for the next process with the same id once the owner dies */
+struct psmbox *psmbox[NPROC];
+/* root of the subscription trie of topic filters, see pubtrie.c - bumping
+   pstrie_gen invalidates the match cache of every path topic */
+struct pstnode pstrie;
+uint32 pstrie_gen;
+/* filter subscriptions of each process, NULL if none */
+struct pstsub *pstsubs[NPROC];
+/* update sequence of retained payload records */
+uint32 psretain_seq;
+/* set when a queue drop marked a retained payload request in rdrop */
+local uint32 psretain_drops;
+/* pubsub counters - updated with PSSTAT_ADD() */
+struct pubsubstats psstats;
+/* payload pools, one per size class */
+bpid32 pspool[PSPOOL_CLASSES];
+/* stream chunk pool and number of the next stream */
+bpid32 pschunk_pool;
+uint32 psstream_seq;
+/* payload pool size classes - buffer size and number of buffers. Buffers
+   carry the 16 byte struct pubbuf header and payloads above the inline
+   limit, so the classes hold payloads of 25-48, 144 and 512 bytes */
+local const uint32 pspool_bufsize[PSPOOL_CLASSES] = { 64, 160, 528 };
+local const uint32 pspool_nbufs[PSPOOL_CLASSES] = { 64, 32, 8 };
+
+/* subscribe queues its retained payload request with the queue code below */
+local void psretain_request(struct pubsubent *psent, topic32 topic, pid32 pid);
+
+/*-------------------------------------------------------------------------
+ * pstopic_hash - first topic table slot probed for a topic id
+ *--------------------------------------------------------------------------
+ */
+local uint32 pstopic_hash(uint32 topic_id)
+{
+	topic_id ^= topic_id >> 16;
+	topic_id *= 0x45D9F3B;
+	topic_id ^= topic_id >> 16;
+	return topic_id & (PSTOPIC_SLOTS - 1);
+}
+
+/*-------------------------------------------------------------------------
+ * pstopic_find - topic table entry of a topic id, NULL if not in use
+ *--------------------------------------------------------------------------
+ */
+local struct pubsubent *pstopic_find(uint32 topic_id)
+{
+	struct pubsubent *psent;
+	uint32 i = pstopic_hash(topic_id);
+	uint32 n = 0;
+
+	// reclaimed slots never match, a table of them ends the probe too
+	while((psent = pstopics[i]) != NULL && n++ < PSTOPIC_SLOTS) {
+		if(psent->topic_id == topic_id) {
+			return psent;
+		}
+		i = (i + 1) & (PSTOPIC_SLOTS - 1);
+	}
+	return NULL;
+}
+
+/*-------------------------------------------------------------------------
+ * pstopic_hold - count a publication about to be queued through psent in
+ *                its qcount. 0 when psent was reclaimed, or reused for
+ *                another topic, since topic_id was looked up - with the
+ *                count held it cannot be reclaimed any more.
+ *--------------------------------------------------------------------------
+ */
+local uint32 pstopic_hold(struct pubsubent *psent, uint32 topic_id)
+{
+	uint32 n;
+
+	n = __sync_add_and_fetch(&psent->qcount, 1);
+	if(psent->topic_id != topic_id) {
+		__sync_sub_and_fetch(&psent->qcount, 1);
+		return 0;
+	}
+	return n;
+}
+
+/*-------------------------------------------------------------------------
+ * pstopic_reclaim - give the entry of a topic without subscribers,
+ *                   settings or queued entries back, mutex held. The
+ *                   entry is kept for reuse, a publisher that looked it
+ *                   up may still hold it.
+ *--------------------------------------------------------------------------
+ */
+local void pstopic_reclaim(struct pubsubent *psent)
+{
+	intmask mask;
+
+	if(psent->count != 0 || psent->qlimit != 0 || psent->prio != PSPRIO_NORMAL
+	    || psent->retain != 0 || psent->conflate != NULL || psent->path != NULL) {
+		return;
+	}
+	// publishers take their count before they check topic_id
+	mask = disable();
+	if(psent->qcount != 0) {
+		restore(mask);
+		return;
+	}
+	psent->topic_id = PSTOPIC_NONE;
+	pstopics[psent->index] = &pstopic_tomb;
+	restore(mask);
+
+	pstopic_count--;
+	if(psent->tmatch != NULL) {
+		freemem((char *) psent->tmatch, psent->tmatchmax * sizeof(struct pstsub *));
+		psent->tmatch = NULL;
+	}
+	if(psent->tpath != NULL) {
+		freemem(psent->tpath, strlen(psent->tpath) + 1);
+		psent->tpath = NULL;
+	}
+	psent->fnext = pstopic_free;
+	pstopic_free = psent;
+}
+
+/*-------------------------------------------------------------------------
+ * pstopic_get - topic table entry of a topic id, allocated on first use,
+ *               mutex held. A full table is swept for entries to reclaim.
+ *               NULL when the table or memory is full.
+ *--------------------------------------------------------------------------
+ */
+local struct pubsubent *pstopic_get(uint32 topic_id)
+{
+	struct pubsubent *psent;
+	uint32 i = 0;
+	uint32 j = 0;
+
+	psent = pstopic_find(topic_id);
+	if(psent != NULL) {
+		return psent;
+	}
+	if(pstopic_count >= PSTOPIC_MAX) {
+		for(i = 0; i < PSTOPIC_SLOTS; i++) {
+			if(PSTOPIC_LIVE(pstopics[i])) {
+				pstopic_reclaim(pstopics[i]);
+			}
+		}
+		if(pstopic_count >= PSTOPIC_MAX) {
+			return NULL;
+		}
+	}
+
+	// first empty or reclaimed slot of the probe sequence
+	i = pstopic_hash(topic_id);
+	while(PSTOPIC_LIVE(pstopics[i])) {
+		i = (i + 1) & (PSTOPIC_SLOTS - 1);
+	}
+
+	if(pstopic_free != NULL) {
+		// a publisher may still count on it, qcount is left alone
+		psent = pstopic_free;
+		pstopic_free = psent->fnext;
+	} else {
+		psent = (struct pubsubent *) getmem(sizeof(struct pubsubent));
+		if(psent == (struct pubsubent *) SYSERR) {
+			return NULL;
+		}
+		psent->topic_id = PSTOPIC_NONE;
+		psent->qcount = 0;
+	}
+
+	psent->index = i;
+	psent->count = 0;
+	// subscriber slots are allocated by the first subscribe
+	psent->psfp_array = NULL;
+	psent->nslots = 0;
+	psent->freelist = PS_NIL;
+	psent->wildcard = PS_NIL;
+	for(j = 0; j < PS_GROUPHASH; j++) {
+		psent->ghash[j] = PS_NIL;
+	}
+	for(j = 0; j < PS_PIDWORDS; j++) {
+		psent->pidmap[j] = 0;
+		psent->rdrop[j] = 0;
+	}
+	psent->qdrop = 0;
+	psent->qlimit = 0;
+	psent->qpolicy = PSQ_BLOCK;
+	psent->prio = PSPRIO_NORMAL;
+	psent->retain = 0;
+	psent->retained = NULL;
+	psent->conflate = NULL;
+	psent->path = NULL;
+	psent->tmatch = NULL;
+	psent->tmatchmax = 0;
+	psent->ntmatch = 0;
+	psent->tmatchgen = 0;
+	psent->tpath = NULL;
+	memset(&psent->stats, 0, sizeof(struct pstopicstats));
+
+	// entry must be complete before lock-free lookups, or publishers still
+	// holding it from before it was reclaimed, can see it
+	__sync_synchronize();
+	psent->topic_id = topic_id;
+	__sync_synchronize();
+	pstopics[i] = psent;
+	pstopic_count++;
+	return psent;
+}
+
+/*-------------------------------------------------------------------------
+ * pshist_bucket - log2 histogram bucket of a value
+ *--------------------------------------------------------------------------
+ */
+local uint32 pshist_bucket(uint32 v)
+{
+	uint32 b;
+
+	if(v == 0) {
+		return 0;
+	}
+	b = 32 - __builtin_clz(v);
+	return (b < PSHIST_BUCKETS) ? b : PSHIST_BUCKETS - 1;
+}
+
+/*-------------------------------------------------------------------------
+ * pscall - run a subscriber handler, topic16 handlers get the topic16 of
+ *          the publication
+ *--------------------------------------------------------------------------
+ */
+local void pscall(void (*handler)(topic16, void *, uint32), bool8 wide, topic32 topic,
+		void *data, uint32 size)
+{
+	if(wide) {
+		((void (*)(topic32, void *, uint32)) handler)(topic, data, size);
+	} else {
+		handler((topic16) topic, data, size);
+	}
+}
+
+/*-------------------------------------------------------------------------
+ * psshard_of - shard a topic is routed to, all publications of a topic go
+ *              through the same queue so they are delivered in order
+ *--------------------------------------------------------------------------
+ */
+local struct pubshard *psshard_of(uint32 topic_id)
+{
+	return &psshard[topic_id % psroute];
+}
+
+/*-------------------------------------------------------------------------
+ * pschain - head of the index list that holds group_id subscribers of a
+ *           topic, group 0 subscribers are kept on the wildcard list
+ *--------------------------------------------------------------------------
+ */
+local int32 *pschain(struct pubsubent *psent, uint32 group_id)
+{
+	if(group_id == 0) {
+		return &psent->wildcard;
+	}
+	return &psent->ghash[group_id & (PS_GROUPHASH - 1)];
+}
+
+/*-------------------------------------------------------------------------
+ * psfp_ref - subscriber slot a PSREF() refers to
+ *--------------------------------------------------------------------------
+ */
+local struct pubsubfp *psfp_ref(int32 ref)
+{
+	return &pstopics[PSREF_TOPIC(ref)]->psfp_array[PSREF_SLOT(ref)];
+}
+
+/*-------------------------------------------------------------------------
+ * psvec_relist - rebuild the free slot list of a topic, slots from init on
+ *                are uninitialized and free
+ *--------------------------------------------------------------------------
+ */
+local void psvec_relist(struct pubsubent *psent, uint32 init)
+{
+	struct pubsubfp *vec = psent->psfp_array;
+	int32 slot;
+
+	// lowest slots are taken first
+	psent->freelist = PS_NIL;
+	for(slot = psent->nslots - 1; slot >= 0; slot--) {
+		if((uint32) slot >= init || vec[slot].subscription_state == 0) {
+			vec[slot].subscription_state = 0;
+			vec[slot].gnext = psent->freelist;
+			psent->freelist = slot;
+		}
+	}
+}
+
+/*-------------------------------------------------------------------------
+ * psvec_resize - move the subscriber slots of a topic to a vector of n
+ *                slots, in-use slots must all be below n. mutex held.
+ *--------------------------------------------------------------------------
+ */
+local status psvec_resize(struct pubsubent *psent, uint32 n)
+{
+	struct pubsubfp *vec;
+	uint32 keep = (n < psent->nslots) ? n : psent->nslots;
+
+	vec = (struct pubsubfp *) getmem(n * sizeof(struct pubsubfp));
+	if(vec == (struct pubsubfp *) SYSERR) {
+		return SYSERR;
+	}
+	if(psent->psfp_array != NULL) {
+		memcpy(vec, psent->psfp_array, keep * sizeof(struct pubsubfp));
+		freemem((char *) psent->psfp_array, psent->nslots * sizeof(struct pubsubfp));
+	}
+	psent->psfp_array = vec;
+	psent->nslots = n;
+	psvec_relist(psent, keep);
+	return OK;
+}
+
+/*-------------------------------------------------------------------------
+ * psslot_alloc - take a free subscriber slot of a topic, the vector is
+ *                allocated or doubled when there is none
+ *--------------------------------------------------------------------------
+ */
+local int32 psslot_alloc(struct pubsubent *psent)
+{
+	uint32 n;
+	int32 slot;
+
+	if(psent->freelist == PS_NIL) {
+		n = (psent->nslots == 0) ? PSFP_MINSLOTS : psent->nslots * 2;
+		if(n > MAX_SUBSCRIBER) {
+			n = MAX_SUBSCRIBER;
+		}
+		if(n <= psent->nslots || psvec_resize(psent, n) == SYSERR) {
+			return SYSERR;
+		}
+	}
+	slot = psent->freelist;
+	psent->freelist = psent->psfp_array[slot].gnext;
+	return slot;
+}
+
+/*-------------------------------------------------------------------------
+ * psslot_move - move an in-use subscriber slot to a free one, fixing the
+ *               group and process lists that refer to it
+ *--------------------------------------------------------------------------
+ */
+local void psslot_move(struct pubsubent *psent, int32 from, int32 to)
+{
+	struct pubsubfp *psfp = &psent->psfp_array[to];
+	int32 ref = PSREF(psent->index, to);
+
+	*psfp = psent->psfp_array[from];
+	psent->psfp_array[from].subscription_state = 0;
+
+	if(psfp->gprev != PS_NIL) {
+		psent->psfp_array[psfp->gprev].gnext = to;
+	} else {
+		*pschain(psent, psfp->group_id) = to;
+	}
+	if(psfp->gnext != PS_NIL) {
+		psent->psfp_array[psfp->gnext].gprev = to;
+	}
+
+	// a process subscribes to a topic once, its neighbours are other topics
+	if(psfp->pprev != PS_NIL) {
+		psfp_ref(psfp->pprev)->pnext = ref;
+	} else {
+		pssubs[psfp->pid] = ref;
+	}
+	if(psfp->pnext != PS_NIL) {
+		psfp_ref(psfp->pnext)->pprev = ref;
+	}
+}
+
+/*-------------------------------------------------------------------------
+ * psvec_compact - free the subscriber vector of a topic nobody subscribes
+ *                 to any more, halve it when at most a quarter is in use
+ *--------------------------------------------------------------------------
+ */
+local void psvec_compact(struct pubsubent *psent)
+{
+	uint32 n = psent->nslots / 2;
+	int32 from;
+	int32 to = 0;
+
+	if(psent->count == 0) {
+		freemem((char *) psent->psfp_array, psent->nslots * sizeof(struct pubsubfp));
+		psent->psfp_array = NULL;
+		psent->nslots = 0;
+		psent->freelist = PS_NIL;
+		return;
+	}
+	if(psent->nslots <= PSFP_MINSLOTS || psent->count > psent->nslots / 4) {
+		return;
+	}
+
+	// slots in the upper half move down to free slots of the lower half
+	for(from = n; (uint32) from < psent->nslots; from++) {
+		if(psent->psfp_array[from].subscription_state == 0) {
+			continue;
+		}
+		while(psent->psfp_array[to].subscription_state != 0) {
+			to++;
+		}
+		psslot_move(psent, from, to);
+	}
+	// keep the old vector if a smaller one cannot be had
+	if(psvec_resize(psent, n) == SYSERR) {
+		psvec_relist(psent, psent->nslots);
+	}
+}
+
+/*-------------------------------------------------------------------------
+ * pslink - insert an in-use slot at the head of its group list
+ *--------------------------------------------------------------------------
+ */
+local void pslink(struct pubsubent *psent, int32 slot)
+{
+	struct pubsubfp *psfp = &psent->psfp_array[slot];
+	int32 *head = pschain(psent, psfp->group_id);
+
+	psfp->gprev = PS_NIL;
+	psfp->gnext = *head;
+	if(*head != PS_NIL) {
+		psent->psfp_array[*head].gprev = slot;
+	}
+	*head = slot;
+}
+
+/*-------------------------------------------------------------------------
+ * psunsub - remove subscriber slot of a topic, mutex held
+ *--------------------------------------------------------------------------
+ */
+local void psunsub(struct pubsubent *psent, int32 slot)
+{
+	struct pubsubfp *psfp = &psent->psfp_array[slot];
+
+	if(psfp->gprev != PS_NIL) {
+		psent->psfp_array[psfp->gprev].gnext = psfp->gnext;
+	} else {
+		*pschain(psent, psfp->group_id) = psfp->gnext;
+	}
+	if(psfp->gnext != PS_NIL) {
+		psent->psfp_array[psfp->gnext].gprev = psfp->gprev;
+	}
+
+	// drop slot from its process subscription list
+	if(psfp->pprev != PS_NIL) {
+		psfp_ref(psfp->pprev)->pnext = psfp->pnext;
+	} else {
+		pssubs[psfp->pid] = psfp->pnext;
+	}
+	if(psfp->pnext != PS_NIL) {
+		psfp_ref(psfp->pnext)->pprev = psfp->pprev;
+	}
+
+	psent->pidmap[psfp->pid >> 5] &= ~(1U << (psfp->pid & 0x1F));
+	psfp->subscription_state = 0;
+	psfp->gnext = psent->freelist;
+	psent->freelist = slot;
+	psent->count--;
+	psvec_compact(psent);
+}
+
+/*-------------------------------------------------------------------------
+ * psretain_collect - take a reference on payloads of a topic retained for
+ *                    a new group_id subscriber, oldest first within a
+ *                    group, mutex held. Returns the number collected.
+ *--------------------------------------------------------------------------
+ */
+local uint32 psretain_collect(struct pubsubent *psent, uint32 group_id, topic32 *topics, char **bufs)
+{
+	struct psretain *rt;
+	uint32 n = 0;
+	uint32 i = 0, j = 0;
+
+	if(psent->retain == 0) {
+		return 0;
+	}
+	for(i = 0; i < PSRETAIN_GROUPS; i++) {
+		rt = &psent->retained[i];
+		// subscriber gets its own group and group 0, wildcard gets every group
+		if(rt->count == 0 || (group_id != 0 && rt->group_id != 0 && rt->group_id != group_id)) {
+			continue;
+		}
+		for(j = 0; j < rt->count; j++) {
+			bufs[n] = rt->bufs[(rt->next + psent->retain - rt->count + j) % psent->retain];
+			topics[n] = PSTOPIC(psent->topic_id, rt->group_id);
+			pubbuf_hold(bufs[n]);
+			n++;
+		}
+	}
+	return n;
+}
+
+/*-------------------------------------------------------------------------
+ * psretain_pending - subscription of pid to a topic still waiting for its
+ *                    retained payloads, NULL if there is none, mutex held
+ *--------------------------------------------------------------------------
+ */
+local struct pubsubfp *psretain_pending(struct pubsubent *psent, pid32 pid)
+{
+	struct pubsubfp *psfp;
+	uint32 i = 0;
+
+	if(!(psent->pidmap[pid >> 5] & (1U << (pid & 0x1F)))) {
+		return NULL;
+	}
+	for(i = 0; i < psent->nslots; i++) {
+		psfp = &psent->psfp_array[i];
+		if(psfp->subscription_state == 1 && psfp->pid == pid) {
+			return psfp->pending ? psfp : NULL;
+		}
+	}
+	return NULL;
+}
+
+/*-------------------------------------------------------------------------
+ * psretain_start - broker reached the retained payload request of pid,
+ *                  collect the payloads and end the wait of its pending
+ *                  subscription, a copy of which goes to psfp. Mutex
+ *                  held, returns the number of payloads collected.
+ *--------------------------------------------------------------------------
+ */
+local uint32 psretain_start(struct pubsubent *psent, pid32 pid, struct pubsubfp *psfp,
+		topic32 *topics, char **bufs)
+{
+	struct pubsubfp *sub;
+
+	sub = psretain_pending(psent, pid);
+	if(sub == NULL) {
+		// unsubscribed meanwhile
+		return 0;
+	}
+	sub->pending = FALSE;
+	*psfp = *sub;
+	return psretain_collect(psent, sub->group_id, topics, bufs);
+}
+
+/*-------------------------------------------------------------------------
+ * psretain_cancel - retained payload request of pid was dropped, the
+ *                   subscription starts from live publications. Runs in
+ *                   publishers without any lock, psretain_reap() ends the
+ *                   wait of the subscription in the broker.
+ *--------------------------------------------------------------------------
+ */
+local void psretain_cancel(struct pubsubent *psent, pid32 pid)
+{
+	__sync_fetch_and_or(&psent->rdrop[pid >> 5], 1U << (pid & 0x1F));
+	// the mark must be visible before the flag sends a broker looking for it
+	__sync_synchronize();
+	psretain_drops = 1;
+}
+
+/*-------------------------------------------------------------------------
+ * psretain_reap - end the wait of subscriptions whose retained payload
+ *                 request was dropped, mutex held
+ *--------------------------------------------------------------------------
+ */
+local void psretain_reap(void)
+{
+	struct pubsubent *psent;
+	struct pubsubfp *sub;
+	uint32 bits;
+	uint32 i = 0, j = 0;
+	pid32 pid;
+
+	if(psretain_drops == 0) {
+		return;
+	}
+	// cleared before the scan, a mark made meanwhile sets it again
+	__sync_lock_test_and_set(&psretain_drops, 0);
+	for(i = 0; i < PSTOPIC_SLOTS; i++) {
+		psent = pstopics[i];
+		if(!PSTOPIC_LIVE(psent)) {
+			continue;
+		}
+		for(j = 0; j < PS_PIDWORDS; j++) {
+			if(psent->rdrop[j] == 0) {
+				continue;
+			}
+			bits = __sync_lock_test_and_set(&psent->rdrop[j], 0);
+			while(bits != 0) {
+				pid = (j << 5) + __builtin_ctz(bits);
+				bits &= bits - 1;
+				sub = psretain_pending(psent, pid);
+				if(sub != NULL) {
+					sub->pending = FALSE;
+				}
+			}
+		}
+	}
+}
+
+/*-------------------------------------------------------------------------
+ * psfilter_match - TRUE if a payload passes a subscriber content filter,
+ *                  payloads too short to hold the field do not
+ *--------------------------------------------------------------------------
+ */
+local bool8 psfilter_match(const struct psfilter *f, char *data, uint32 size)
+{
+	uint8 *p = (uint8 *) data + f->offset;
+	uint32 v;
+
+	if(f->op == PSF_ALL) {
+		return TRUE;
+	}
+	if(f->offset + f->width > size) {
+		return FALSE;
+	}
+	v = p[0];
+	if(f->width >= 2) {
+		v |= p[1] << 8;
+	}
+	if(f->width == 4) {
+		v |= (p[2] << 16) | ((uint32) p[3] << 24);
+	}
+	if(f->op == PSF_RANGE) {
+		return (v >= f->a && v <= f->b);
+	}
+	return ((v & f->a) == f->b);
+}
+
+/*-------------------------------------------------------------------------
+ * pssubscribe - subscribe a function to a particular group and topic with
+ *               the given delivery mode and content filter (NULL - none),
+ *               retained payloads of the topic are delivered before any
+ *               publication queued after the subscription
+ *--------------------------------------------------------------------------
+ */
+local syscall pssubscribe(topic32 topic, void (*handler)(topic16, void *, uint32), bool8 wide,
+		uint32 delivery, const struct psfilter *filter)
+{
+	uint32 topic_id;
+	uint32 group_id;
+	pid32 pid = getpid();
+	int32 slot;
+	struct pubsubent *psent;
+	struct pubsubfp *psfp;
+	bool8 pending;
+
+	topic_id = PSTOPIC_ID(topic);
+	group_id = PSTOPIC_GROUP(topic);
+
+	// a topic16 handler cannot be told about topic ids above MAX_TOPIC
+	if(!wide && topic_id >= MAX_TOPIC) {
+		return SYSERR;
+	}
+	if(filter != NULL && (filter->op > PSF_MASK
+	    || (filter->width != 1 && filter->width != 2 && filter->width != 4))) {
+		return SYSERR;
+	}
+
+	wait(mutex);
+
+	psent = pstopic_get(topic_id);
+	if(psent == NULL) {
+		signal(mutex);
+		return SYSERR;
+	}
+
+	//return error if the process has already subscribed for the topic in some other group
+	if(psent->pidmap[pid >> 5] & (1U << (pid & 0x1F))) {
+		signal(mutex);
+		return SYSERR;
+	}
+
+	slot = psslot_alloc(psent);
+	if(slot == SYSERR) {
+		signal(mutex);
+		return SYSERR;
+	}
+
+	PSTRACE(PSTRACE_SUBS, PSTR_SUBSCRIBE, topic, NULL, 0);
+	psfp = &psent->psfp_array[slot];
+	psfp->pid = pid;
+	psfp->handler = handler;
+	psfp->wide = wide;
+	psfp->subscription_state = 1;
+	psfp->delivery = delivery;
+	if(filter != NULL) {
+		psfp->filter = *filter;
+	} else {
+		psfp->filter.op = PSF_ALL;
+	}
+	psfp->group_id = group_id;
+	pslink(psent, slot);
+	psent->count++;
+
+	// add slot to the process subscription list for unsubscribe_pub_sub()
+	psfp->pprev = PS_NIL;
+	psfp->pnext = pssubs[pid];
+	if(pssubs[pid] != PS_NIL) {
+		psfp_ref(pssubs[pid])->pprev = PSREF(psent->index, slot);
+	}
+	pssubs[pid] = PSREF(psent->index, slot);
+	psent->pidmap[pid >> 5] |= 1U << (pid & 0x1F);
+	// a mark left by an earlier subscription must not cancel this one
+	__sync_fetch_and_and(&psent->rdrop[pid >> 5], ~(1U << (pid & 0x1F)));
+
+	// retained payloads go out in queue order with live publications
+	// the slot vector may move once mutex is released, keep a copy
+	pending = (psent->retain > 0);
+	psfp->pending = pending;
+	signal(mutex);
+
+	if(pending) {
+		psretain_request(psent, topic, pid);
+	}
+	return OK;
+}
+
+/*-------------------------------------------------------------------------
+ * subscribe - subscribe a function to a particular group and topic, the
+ *             handler is called by the broker
+ *--------------------------------------------------------------------------
+ */
+syscall subscribe(topic32 topic, void (*handler)(topic16, void *, uint32))
+{
+	return pssubscribe(topic, handler, FALSE, PSDLV_BROKER, NULL);
+}
+
+/*-------------------------------------------------------------------------
+ * subscribe32 - subscribe a handler that takes the topic32 of publications,
+ *               needed for topic ids of MAX_TOPIC and above
+ *--------------------------------------------------------------------------
+ */
+syscall subscribe32(topic32 topic, void (*handler)(topic32, void *, uint32))
+{
+	return pssubscribe(topic, (void (*)(topic16, void *, uint32)) handler, TRUE, PSDLV_BROKER, NULL);
+}
+
+/*-------------------------------------------------------------------------
+ * subscribe_filter - subscribe a function to a particular group and topic,
+ *                    broker only calls it for publications whose payload
+ *                    passes filter
+ *--------------------------------------------------------------------------
+ */
+syscall subscribe_filter(topic32 topic, void (*handler)(topic16, void *, uint32),
+		const struct psfilter *filter)
+{
+	return pssubscribe(topic, handler, FALSE, PSDLV_BROKER, filter);
+}
+
+/*-------------------------------------------------------------------------
+ * subscribe32_filter - subscribe_filter() for a handler taking a topic32
+ *--------------------------------------------------------------------------
+ */
+syscall subscribe32_filter(topic32 topic, void (*handler)(topic32, void *, uint32),
+		const struct psfilter *filter)
+{
+	return pssubscribe(topic, (void (*)(topic16, void *, uint32)) handler, TRUE, PSDLV_BROKER, filter);
+}
+
+/*-------------------------------------------------------------------------
+ * psmbox_create - give process pid a mailbox unless it already has one
+ *--------------------------------------------------------------------------
+ */
+local status psmbox_create(pid32 pid)
+{
+	intmask mask;
+	struct psmbox *mb;
+
+	if(psmbox[pid] != NULL) {
+		psmbox[pid]->owner = pid;
+		return OK;
+	}
+	mb = (struct psmbox *) getmem(sizeof(struct psmbox));
+	if(mb == (struct psmbox *) SYSERR) {
+		return SYSERR;
+	}
+	mb->head = 0;
+	mb->tail = 0;
+	mb->owner = pid;
+	mb->items = semcreate(0);
+	if(mb->items == SYSERR) {
+		freemem((char *) mb, sizeof(struct psmbox));
+		return SYSERR;
+	}
+
+	mask = disable();
+	psmbox[pid] = mb;
+	restore(mask);
+	return OK;
+}
+
+/*-------------------------------------------------------------------------
+ * subscribe_mbox - subscribe a function to a particular group and topic,
+ *                  broker queues messages in the caller's mailbox and the
+ *                  caller runs the handler itself from pubsub_receive()
+ *--------------------------------------------------------------------------
+ */
+syscall subscribe_mbox(topic32 topic, void (*handler)(topic16, void *, uint32))
+{
+	if(psmbox_create(getpid()) == SYSERR) {
+		return SYSERR;
+	}
+	return pssubscribe(topic, handler, FALSE, PSDLV_MBOX, NULL);
+}
+
+/*-------------------------------------------------------------------------
+ * subscribe32_mbox - subscribe_mbox() for a handler taking a topic32
+ *--------------------------------------------------------------------------
+ */
+syscall subscribe32_mbox(topic32 topic, void (*handler)(topic32, void *, uint32))
+{
+	if(psmbox_create(getpid()) == SYSERR) {
+		return SYSERR;
+	}
+	return pssubscribe(topic, (void (*)(topic16, void *, uint32)) handler, TRUE, PSDLV_MBOX, NULL);
+}
+
+/*-------------------------------------------------------------------------
+ * psmbox_purge - drop the messages of a topic from the mailbox of its
+ *                owner pid, who is not blocked in pubsub_receive()
+ *--------------------------------------------------------------------------
+ */
+local void psmbox_purge(pid32 pid, uint32 topic_id)
+{
+	intmask mask;
+	struct psmbox *mb;
+	struct psmsg *msg;
+	uint32 i = 0, n = 0;
+
+	mask = disable();
+	mb = psmbox[pid];
+	if(mb == NULL || mb->owner != pid) {
+		restore(mask);
+		return;
+	}
+	// keep the other messages in order, n counts those kept
+	for(i = mb->head; i != mb->tail; i++) {
+		msg = &mb->msgs[i % PSMBOX_SIZE];
+		if(PSTOPIC_ID(msg->topic) != topic_id) {
+			if(i != mb->head + n) {
+				memcpy(&mb->msgs[(mb->head + n) % PSMBOX_SIZE], msg, sizeof(struct psmsg));
+			}
+			n++;
+		} else if(msg->data != NULL) {
+			pubbuf_release(msg->data);
+		}
+	}
+	if(mb->head + n != mb->tail) {
+		mb->tail = mb->head + n;
+		semreset(mb->items, n);
+	}
+	restore(mask);
+}
+
+/*-------------------------------------------------------------------------
+ * unsubscribe - unsubscribe from a particular group and topic
+ *--------------------------------------------------------------------------
+ */
+syscall unsubscribe(topic32 topic)
+{
+	uint32 topic_id;
+	uint32 group_id;
+	pid32 pid = getpid();
+	int32 slot;
+	struct pubsubent *psent;
+
+	topic_id = PSTOPIC_ID(topic);
+	group_id = PSTOPIC_GROUP(topic);
+
+	// looked up under mutex, the entry may be reclaimed otherwise
+	wait(mutex);
+	psent = pstopic_find(topic_id);
+	if(psent == NULL) {
+		signal(mutex);
+		return OK;
+	}
+	// only subscribers hashed to the same group list are visited
+	for(slot = *pschain(psent, group_id); slot != PS_NIL;
+	    slot = psent->psfp_array[slot].gnext) {
+		if( psent->psfp_array[slot].pid == pid && psent->psfp_array[slot].group_id == group_id ) {
+			PSTRACE(PSTRACE_SUBS, PSTR_UNSUBSCRIBE, topic, NULL, 0);
+			psunsub(psent, slot);
+			pstopic_reclaim(psent);
+			break;
+		}
+	}
+	signal(mutex);
+
+	// queued messages would run the old handler and pin their buffers
+	psmbox_purge(pid, topic_id);
+	return OK;	
+}
+
+/*-------------------------------------------------------------------------
+ * subscribe_path - subscribe a handler to a topic filter such as
+ *                  sensors/+/temp or sensors/#, the handler receives every
+ *                  publish_path() to a matching path
+ *--------------------------------------------------------------------------
+ */
+syscall subscribe_path(char *filter, void (*handler)(topic32, void *, uint32))
+{
+	pid32 pid = getpid();
+	struct pstsub *sub;
+
+	if(filter == NULL || handler == NULL) {
+		return SYSERR;
+	}
+	sub = (struct pstsub *) getmem(sizeof(struct pstsub));
+	if(sub == (struct pstsub *) SYSERR) {
+		return SYSERR;
+	}
+	sub->pid = pid;
+	sub->handler = handler;
+
+	wait(mutex);
+	if(pstrie_find(&pstrie, filter, pid) != NULL || pstrie_insert(&pstrie, filter, sub) == SYSERR) {
+		signal(mutex);
+		freemem((char *) sub, sizeof(struct pstsub));
+		return SYSERR;
+	}
+	sub->pnext = pstsubs[pid];
+	pstsubs[pid] = sub;
+	pstrie_gen++;
+	signal(mutex);
+
+	PSTRACE(PSTRACE_SUBS, PSTR_SUBPATH, 0, filter, strlen(filter));
+	return OK;
+}
+
+/*-------------------------------------------------------------------------
+ * pstsub_drop - remove a filter subscription from the trie and from its
+ *               process list and free it, mutex held
+ *--------------------------------------------------------------------------
+ */
+local void pstsub_drop(struct pstsub *sub)
+{
+	struct pstsub **prev;
+
+	pstrie_remove(sub);
+	for(prev = &pstsubs[sub->pid]; *prev != NULL; prev = &(*prev)->pnext) {
+		if(*prev == sub) {
+			*prev = sub->pnext;
+			break;
+		}
+	}
+	pstrie_gen++;
+	freemem((char *) sub, sizeof(struct pstsub));
+}
+
+/*-------------------------------------------------------------------------
+ * unsubscribe_path - unsubscribe from a topic filter
+ *--------------------------------------------------------------------------
+ */
+syscall unsubscribe_path(char *filter)
+{
+	struct pstsub *sub;
+
+	if(filter == NULL) {
+		return SYSERR;
+	}
+	wait(mutex);
+	sub = pstrie_find(&pstrie, filter, getpid());
+	if(sub != NULL) {
+		PSTRACE(PSTRACE_SUBS, PSTR_UNSUBPATH, 0, filter, strlen(filter));
+		pstsub_drop(sub);
+	}
+	signal(mutex);
+	return OK;
+}
+
+/*-------------------------------------------------------------------------
+ * psdlv_add - append a subscriber to a delivery list, the shard's list
+ *             entries are doubled when full
+ *--------------------------------------------------------------------------
+ */
+local void psdlv_add(struct pubshard *sh, struct pubdelivery *dlv,
+		void (*handler)(topic16, void *, uint32), bool8 wide, pid32 mbox)
+{
+	struct psdlvent *vec;
+	struct psdlvent *d;
+
+	if(sh->ndlv == sh->dlvmax) {
+		vec = (struct psdlvent *) getmem(2 * sh->dlvmax * sizeof(struct psdlvent));
+		if(vec == (struct psdlvent *) SYSERR) {
+			PSSTAT_ADD(dlv_nomem, 1);
+			return;
+		}
+		memcpy(vec, sh->dlvv, sh->ndlv * sizeof(struct psdlvent));
+		freemem((char *) sh->dlvv, sh->dlvmax * sizeof(struct psdlvent));
+		sh->dlvv = vec;
+		sh->dlvmax *= 2;
+	}
+	d = &sh->dlvv[sh->ndlv++];
+	d->handler = handler;
+	d->wide = wide;
+	d->mbox = mbox;
+	dlv->nhandlers++;
+}
+
+/*-------------------------------------------------------------------------
+ * psdlv_addfp - append a topic subscriber to a delivery list unless its
+ *               content filter rejects the payload
+ *--------------------------------------------------------------------------
+ */
+local void psdlv_addfp(struct pubshard *sh, struct pubdelivery *dlv, struct pubsubfp *psfp)
+{
+	// retained payloads come first, this publication is one of them
+	if(psfp->pending) {
+		return;
+	}
+	if(!psfilter_match(&psfp->filter, dlv->data, dlv->size)) {
+		PSSTAT_ADD(filtered, 1);
+		return;
+	}
+	psdlv_add(sh, dlv, psfp->handler, psfp->wide, (psfp->delivery == PSDLV_MBOX) ? psfp->pid : SYSERR);
+}
+
+/*-------------------------------------------------------------------------
+ * psdeliverylist - collect subscribers of a topic that receive a group_id
+ *                  publication into the shard's list entries, mutex held
+ *--------------------------------------------------------------------------
+ */
+local void psdeliverylist(struct pubshard *sh, struct pubdelivery *dlv, struct pubsubent *psent,
+		uint32 group_id)
+{
+	int32 slot;
+	uint32 b = 0;
+
+	dlv->first = sh->ndlv;
+	dlv->nhandlers = 0;
+
+	// wildcard subscribers receive every group of the topic
+	for(slot = psent->wildcard; slot != PS_NIL; slot = psent->psfp_array[slot].gnext) {
+		psdlv_addfp(sh, dlv, &psent->psfp_array[slot]);
+	}
+
+	if(group_id == 0) {
+		// publication to group 0 goes to every subscriber of the topic
+		for(b = 0; b < PS_GROUPHASH; b++) {
+			for(slot = psent->ghash[b]; slot != PS_NIL; slot = psent->psfp_array[slot].gnext) {
+				psdlv_addfp(sh, dlv, &psent->psfp_array[slot]);
+			}
+		}
+		return;
+	}
+
+	for(slot = psent->ghash[group_id & (PS_GROUPHASH - 1)]; slot != PS_NIL;
+	    slot = psent->psfp_array[slot].gnext) {
+		if(psent->psfp_array[slot].group_id == group_id) {
+			psdlv_addfp(sh, dlv, &psent->psfp_array[slot]);
+		}
+	}
+}
+
+/*-------------------------------------------------------------------------
+ * pstrie_cached - TRUE when the match cache of psent holds the filter
+ *                 subscriptions matching path, mutex held. A path topic
+ *                 caches its own path, the shared path entry the path of
+ *                 its last publication.
+ *--------------------------------------------------------------------------
+ */
+local bool8 pstrie_cached(struct pubsubent *psent, char *path)
+{
+	if(psent->tmatchgen != pstrie_gen) {
+		return FALSE;
+	}
+	return psent->path != NULL || (psent->tpath != NULL && strcmp(psent->tpath, path) == 0);
+}
+
+/*-------------------------------------------------------------------------
+ * pstrie_deliverylist - append the filter subscriptions matching path, of
+ *                       a publication through psent, to a delivery list,
+ *                       mutex held. The trie is only walked when a
+ *                       subscribe or unsubscribe changed it, or the path
+ *                       differs, since the last publication.
+ *--------------------------------------------------------------------------
+ */
+local void pstrie_deliverylist(struct pubshard *sh, struct pubdelivery *dlv, struct pubsubent *psent,
+		char *path)
+{
+	struct pstsub **vec;
+	uint32 i = 0;
+	uint32 n;
+
+	if(!pstrie_cached(psent, path)) {
+		psent->tmatchgen = 0;
+		if(psent->path == NULL) {
+			// remember the path of the shared entry's cache
+			if(psent->tpath != NULL) {
+				freemem(psent->tpath, strlen(psent->tpath) + 1);
+			}
+			psent->tpath = getmem(strlen(path) + 1);
+			if(psent->tpath == (char *) SYSERR) {
+				psent->tpath = NULL;
+			} else {
+				strcpy(psent->tpath, path);
+			}
+		}
+		n = pstrie_match(&pstrie, path, psent->tmatch, psent->tmatchmax);
+		if(n > psent->tmatchmax) {
+			// cache grows to the number of matches, walk again to fill it
+			vec = (struct pstsub **) getmem(n * sizeof(struct pstsub *));
+			if(vec != (struct pstsub **) SYSERR) {
+				if(psent->tmatch != NULL) {
+					freemem((char *) psent->tmatch, psent->tmatchmax * sizeof(struct pstsub *));
+				}
+				psent->tmatch = vec;
+				psent->tmatchmax = n;
+				pstrie_match(&pstrie, path, psent->tmatch, n);
+			}
+		}
+		if(n > psent->tmatchmax) {
+			// partial cache, the trie is walked again next time
+			PSSTAT_ADD(dlv_nomem, n - psent->tmatchmax);
+			n = psent->tmatchmax;
+		} else if(psent->path != NULL || psent->tpath != NULL) {
+			psent->tmatchgen = pstrie_gen;
+		}
+		psent->ntmatch = n;
+	}
+
+	for(i = 0; i < psent->ntmatch; i++) {
+		psdlv_add(sh, dlv, (void (*)(topic16, void *, uint32)) psent->tmatch[i]->handler, TRUE, SYSERR);
+	}
+}
+
+/*-------------------------------------------------------------------------
+ * pspayload_get - allocate payload buffer from the smallest fitting pool
+ *                 with a free buffer, fall back to heap when every
+ *                 fitting pool is exhausted
+ *--------------------------------------------------------------------------
+ */
+local char *pspayload_get(uint32 size, bpid32 *poolid)
+{
+	intmask mask;
+	uint32 i = 0;
+	char *buf;
+
+	*poolid = PSPOOL_HEAP;
+	for(i = 0; i < PSPOOL_CLASSES; i++) {
+		if(pspool[i] == SYSERR || size > pspool_bufsize[i]) {
+			continue;
+		}
+		// getbuf() blocks on an empty pool, take a buffer only if one is
+		// free - interrupts stay off so no other process can take it first
+		mask = disable();
+		if(semcount(buftab[pspool[i]].bpsem) > 0) {
+			buf = getbuf(pspool[i]);
+			restore(mask);
+			PSSTAT_ADD(pool_hits, 1);
+			*poolid = pspool[i];
+			return buf;
+		}
+		restore(mask);
+		// try the next larger class before the heap
+		PSSTAT_ADD(pool_misses, 1);
+	}
+
+	PSSTAT_ADD(heap_allocs, 1);
+	buf = getmem(size);
+	return buf;
+}
+
+/*-------------------------------------------------------------------------
+ * pubbuf_get - allocate a message buffer with refcount 1
+ *--------------------------------------------------------------------------
+ */
+local char *pubbuf_get(uint32 size)
+{
+	struct pubbuf *pbuf;
+	bpid32 poolid;
+
+	pbuf = (struct pubbuf *) pspayload_get(sizeof(struct pubbuf) + size, &poolid);
+	if(pbuf == (struct pubbuf *) SYSERR) {
+		return (char *) SYSERR;
+	}
+	pbuf->magic = PUBBUF_MAGIC;
+	pbuf->refcount = 1;
+	pbuf->size = size;
+	pbuf->poolid = poolid;
+	return (char *) (pbuf + 1);
+}
+
+/*-------------------------------------------------------------------------
+ * pubbuf_alloc - allocate a message buffer for publish_buf(), the caller
+ *                owns the only reference
+ *--------------------------------------------------------------------------
+ */
+char *pubbuf_alloc(uint32 size)
+{
+	return pubbuf_get(size);
+}
+
+/*-------------------------------------------------------------------------
+ * pubbuf_addref - add n references to a message buffer
+ *--------------------------------------------------------------------------
+ */
+local void pubbuf_addref(char *buf, uint32 n)
+{
+	intmask mask;
+	struct pubbuf *pbuf = ((struct pubbuf *) buf) - 1;
+
+	mask = disable();
+	pbuf->refcount += n;
+	restore(mask);
+}
+
+/*-------------------------------------------------------------------------
+ * pubbuf_hold - take an extra reference on a message buffer, e.g. to keep
+ *               a payload after the handler returns. Payloads up to
+ *               PUBSUB_INLINE_MAX bytes are delivered from an inline copy,
+ *               not a message buffer, handlers must copy them instead.
+ *               SYSERR for such a copy or any other non message buffer.
+ *--------------------------------------------------------------------------
+ */
+syscall pubbuf_hold(char *buf)
+{
+	if(buf == NULL || buf == (char *) SYSERR) {
+		return SYSERR;
+	}
+	if((((struct pubbuf *) buf) - 1)->magic != PUBBUF_MAGIC) {
+		return SYSERR;
+	}
+	pubbuf_addref(buf, 1);
+	return OK;
+}
+
+/*-------------------------------------------------------------------------
+ * pubbuf_release - drop a reference, free the buffer with the last one,
+ *                  SYSERR for anything that is not a message buffer
+ *--------------------------------------------------------------------------
+ */
+syscall pubbuf_release(char *buf)
+{
+	intmask mask;
+	struct pubbuf *pbuf;
+	uint32 refcount;
+
+	if(buf == NULL || buf == (char *) SYSERR) {
+		return SYSERR;
+	}
+	pbuf = ((struct pubbuf *) buf) - 1;
+	if(pbuf->magic != PUBBUF_MAGIC) {
+		return SYSERR;
+	}
+
+	mask = disable();
+	refcount = --pbuf->refcount;
+	restore(mask);
+
+	if(refcount == 0) {
+		pbuf->magic = 0;
+		if(pbuf->poolid == PSPOOL_HEAP) {
+			freemem((char *) pbuf, sizeof(struct pubbuf) + pbuf->size);
+		} else {
+			freebuf((char *) pbuf);
+		}
+	}
+	return OK;
+}
+
+/*-------------------------------------------------------------------------
+ * pschunk_is - TRUE for a message buffer from the stream chunk pool
+ *--------------------------------------------------------------------------
+ */
+local bool8 pschunk_is(char *buf)
+{
+	return pschunk_pool != SYSERR && (((struct pubbuf *) buf) - 1)->poolid == pschunk_pool;
+}
+
+/*-------------------------------------------------------------------------
+ * pubbuf_keep - new reference to the payload of dlv for keeping it past
+ *               the broker's batch. Inline payloads and stream chunks are
+ *               copied to a message buffer of their own, publishers wait
+ *               on the chunk pool and must not wait on a slow subscriber.
+ *               SYSERR when no buffer is left.
+ *--------------------------------------------------------------------------
+ */
+local char *pubbuf_keep(struct pubdelivery *dlv)
+{
+	char *buf;
+
+	if(dlv->data != dlv->inl && !pschunk_is(dlv->data)) {
+		pubbuf_addref(dlv->data, 1);
+		return dlv->data;
+	}
+	buf = pubbuf_get(dlv->size);
+	if(buf == (char *) SYSERR) {
+		return (char *) SYSERR;
+	}
+	memcpy(buf, dlv->data, dlv->size);
+	return buf;
+}
+
+/*-------------------------------------------------------------------------
+ * psretain_put - retain the payload of a publication dequeued by broker,
+ *                mutex held. The newest payload replaces the oldest once
+ *                the group has the topic's retain depth of them.
+ *--------------------------------------------------------------------------
+ */
+local void psretain_put(struct pubdelivery *dlv, struct pubsubent *psent, uint32 group_id)
+{
+	struct psretain *rt = NULL;
+	char *buf;
+	uint32 i = 0;
+
+	for(i = 0; i < PSRETAIN_GROUPS; i++) {
+		if(psent->retained[i].count > 0 && psent->retained[i].group_id == group_id) {
+			rt = &psent->retained[i];
+			break;
+		}
+	}
+	if(rt == NULL) {
+		// take the least recently updated record, empty ones first
+		rt = &psent->retained[0];
+		for(i = 1; i < PSRETAIN_GROUPS; i++) {
+			if(psent->retained[i].used < rt->used) {
+				rt = &psent->retained[i];
+			}
+		}
+		for(i = 0; i < rt->count; i++) {
+			pubbuf_release(rt->bufs[i]);
+		}
+		rt->group_id = group_id;
+		rt->count = 0;
+		rt->next = 0;
+	}
+
+	buf = pubbuf_keep(dlv);
+	if(buf == (char *) SYSERR) {
+		return;
+	}
+
+	if(rt->count == psent->retain) {
+		pubbuf_release(rt->bufs[rt->next]);
+	} else {
+		rt->count++;
+	}
+	rt->bufs[rt->next] = buf;
+	rt->next = (rt->next + 1) % psent->retain;
+	rt->used = ++psretain_seq;
+}
+
+/*-------------------------------------------------------------------------
+ * pubq_wait - block until the shard's broker drains a batch, unless room
+ *             appeared.
+ *             The check and the wait happen with interrupts disabled so a
+ *             wakeup from broker cannot be missed.
+ *--------------------------------------------------------------------------
+ */
+local void pubq_wait(struct pubshard *sh, struct pubsubent *psent, bool8 bytopic)
+{
+	intmask mask;
+	bool8 full;
+
+	mask = disable();
+	if(bytopic) {
+		full = psent->qcount >= psent->qlimit;
+	} else {
+		full = pubq_count(&sh->q[psent->prio]) >= pubq_limit;
+	}
+	if(full) {
+		sh->waiters++;
+		wait(sh->room);
+	}
+	restore(mask);
+}
+
+/*-------------------------------------------------------------------------
+ * psbroker_self - TRUE when called by a broker, e.g. from a handler
+ *--------------------------------------------------------------------------
+ */
+local bool8 psbroker_self(void)
+{
+	pid32 pid = getpid();
+	uint32 i = 0;
+
+	for(i = 0; i < psnshards; i++) {
+		if(psshard[i].pid == pid) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/*-------------------------------------------------------------------------
+ * pubq_policy_for - overflow policy to apply, PSQ_BLOCK is not allowed
+ *                   for a handler publishing from any broker context
+ *--------------------------------------------------------------------------
+ */
+local uint32 pubq_policy_for(uint32 policy)
+{
+	if(policy == PSQ_BLOCK && psbroker_self()) {
+		return PSQ_REJECT;
+	}
+	return policy;
+}
+
+/*-------------------------------------------------------------------------
+ * pubq_live - account for an entry of a topic leaving the queue, FALSE
+ *             when a PSQ_DROPOLD topic limit asked for it to be discarded
+ *--------------------------------------------------------------------------
+ */
+local bool8 pubq_live(struct pubsubent *psent)
+{
+	uint32 qdrop;
+
+	// the oldest entries of a topic are the ones discarded for newer ones,
+	// the discarded entry still holds the credit of its queue position
+	while((qdrop = psent->qdrop) > 0) {
+		if(__sync_bool_compare_and_swap(&psent->qdrop, qdrop, qdrop - 1)) {
+			__sync_sub_and_fetch(&psent->qcount, 1);
+			return FALSE;
+		}
+	}
+	__sync_sub_and_fetch(&psent->qcount, 1);
+	return TRUE;
+}
+
+/*-------------------------------------------------------------------------
+ * pubq_qhigh - raise the topic's queue depth high-water mark to n
+ *--------------------------------------------------------------------------
+ */
+local void pubq_qhigh(struct pubsubent *psent, uint32 n)
+{
+	uint32 high;
+
+	while((high = psent->stats.qhigh) < n) {
+		if(__sync_bool_compare_and_swap(&psent->stats.qhigh, high, n)) {
+			break;
+		}
+	}
+}
+
+/*-------------------------------------------------------------------------
+ * pubq_topicadmit - take one queued entry credit of a topic under its
+ *                   limit. Returns OK, SYSERR to reject or PUBQ_DISCARD
+ *                   to drop the new publication.
+ *--------------------------------------------------------------------------
+ */
+local status pubq_topicadmit(struct pubsubent *psent, topic32 topic)
+{
+	uint32 n;
+
+	while(1) {
+		n = pstopic_hold(psent, PSTOPIC_ID(topic));
+		if(n == 0) {
+			PSSTAT_ADD(no_topic, 1);
+			return PUBQ_DISCARD;
+		}
+		if(n <= psent->qlimit || psent->qlimit == 0) {
+			pubq_qhigh(psent, n);
+			return OK;
+		}
+
+		switch(pubq_policy_for(psent->qpolicy)) {
+		case PSQ_DROPOLD:
+			// broker discards the oldest entry of the topic and gives its credit back
+			__sync_add_and_fetch(&psent->qdrop, 1);
+			PSSTAT_ADD(dropped_old, 1);
+			return OK;
+
+		case PSQ_BLOCK:
+			__sync_sub_and_fetch(&psent->qcount, 1);
+			PSSTAT_ADD(blocked, 1);
+			// without a credit the topic may be routed elsewhere meanwhile
+			pubq_wait(psshard_of(psent->topic_id), psent, TRUE);
+			break;
+
+		case PSQ_DROPNEW:
+			__sync_sub_and_fetch(&psent->qcount, 1);
+			PSSTAT_ADD(dropped_new, 1);
+			return PUBQ_DISCARD;
+
+		default:
+			__sync_sub_and_fetch(&psent->qcount, 1);
+			PSSTAT_ADD(rejected, 1);
+			return SYSERR;
+		}
+	}
+}
+
+/*-------------------------------------------------------------------------
+ * psconflate_take - take the payload out of the conflation cell a queue
+ *                   entry refers to. It moves into dlv, or is released
+ *                   when dlv is NULL because the entry is discarded.
+ *--------------------------------------------------------------------------
+ */
+local void psconflate_take(struct pubsubent *psent, topic32 topic, struct pubdelivery *dlv)
+{
+	intmask mask;
+	struct psconflate *cell;
+	char *buf;
+
+	mask = disable();
+	cell = &psent->conflate[PSTOPIC_GROUP(topic)];
+	cell->queued = FALSE;
+	buf = cell->data;
+	cell->data = NULL;
+	if(dlv != NULL) {
+		dlv->size = cell->size;
+		if(buf == NULL) {
+			memcpy(dlv->inl, cell->inl, cell->size);
+			dlv->data = dlv->inl;
+		} else {
+			dlv->data = buf;
+		}
+	}
+	restore(mask);
+
+	if(dlv == NULL && buf != NULL) {
+		pubbuf_release(buf);
+	}
+}
+
+/*-------------------------------------------------------------------------
+ * pubq_entdrop - release the payload of a queue entry that is discarded
+ *--------------------------------------------------------------------------
+ */
+local void pubq_entdrop(struct publishqueue *ent)
+{
+	if(ent->replay != SYSERR) {
+		__sync_sub_and_fetch(&ent->psent->qcount, 1);
+		psretain_cancel(ent->psent, ent->replay);
+	} else if(ent->conflated) {
+		psconflate_take(ent->psent, ent->topic, NULL);
+	} else if(ent->data != NULL) {
+		pubbuf_release(ent->data);
+	}
+}
+
+/*-------------------------------------------------------------------------
+ * pubq_append - append a publication to the queue of the topic's shard
+ *               without taking any lock. With buf NULL the size bytes at
+ *               data are stored inline in the queue entry. An entry with
+ *               conflated set carries no payload, the topic group's
+ *               conflation cell holds it. Applies topic and system limits.
+ *               Returns OK, SYSERR to reject or PUBQ_DISCARD to drop it.
+ *--------------------------------------------------------------------------
+ */
+local status pubq_append(struct pubsubent *psent, topic32 topic, char *buf, char *data, uint32 size,
+		bool8 conflated)
+{
+	struct pubshard *sh;
+	struct pubqueue *q;
+	struct publishqueue *ent;
+	uint32 pos;
+	status retval;
+
+	// the credit keeps shard and priority class fixed until the entry is queued
+	retval = pubq_topicadmit(psent, topic);
+	if(retval != OK) {
+		return retval;
+	}
+	sh = psshard_of(psent->topic_id);
+	q = &sh->q[psent->prio];
+
+	while(1) {
+		if(pubq_count(q) < pubq_limit) {
+			ent = pubq_reserve(q, &pos);
+			if(ent != NULL) {
+				break;
+			}
+		}
+
+		switch(pubq_policy_for(pubq_policy)) {
+		case PSQ_BLOCK:
+			PSSTAT_ADD(blocked, 1);
+			pubq_wait(sh, psent, FALSE);
+			break;
+
+		case PSQ_DROPOLD:
+			// take the oldest entry of the class ourselves to free its position
+			ent = pubq_take(q, &pos);
+			if(ent != NULL) {
+				if(ent->replay == SYSERR && pubq_live(ent->psent)) {
+					PSSTAT_ADD(dropped_old, 1);
+					PSTSTAT_ADD(ent->psent, drops, 1);
+				}
+				pubq_entdrop(ent);
+				pubq_release(q, ent, pos);
+				break;
+			}
+			if(pubq_count(q) < pubq_limit) {
+				// the broker made room meanwhile
+				break;
+			}
+			// oldest entry is reserved but not committed, its publisher may
+			// not run before us - drop the new publication, never spin
+			__sync_sub_and_fetch(&psent->qcount, 1);
+			PSSTAT_ADD(dropped_new, 1);
+			return PUBQ_DISCARD;
+
+		case PSQ_DROPNEW:
+			__sync_sub_and_fetch(&psent->qcount, 1);
+			PSSTAT_ADD(dropped_new, 1);
+			return PUBQ_DISCARD;
+
+		default:
+			__sync_sub_and_fetch(&psent->qcount, 1);
+			PSSTAT_ADD(rejected, 1);
+			return SYSERR;
+		}
+	}
+
+	ent->stamp = getticks();
+	ent->topic = topic;
+	ent->psent = psent;
+	ent->conflated = conflated;
+	ent->replay = SYSERR;
+	ent->data = buf;
+	ent->size = size;
+	if(buf == NULL && size > 0) {
+		memcpy(ent->inl, data, size);
+	}
+	pubq_commit(q, ent, pos);
+
+	// wake up the shard's broker for the new entry
+	signal(sh->items);
+	return OK;
+}
+
+/*-------------------------------------------------------------------------
+ * psretain_request - queue the retained payload request of a pending
+ *                    subscriber of pid behind the publications of the
+ *                    topic queued before it. A broker cannot wait for
+ *                    queue room, its subscriber starts from live
+ *                    publications when the queue is full.
+ *--------------------------------------------------------------------------
+ */
+local void psretain_request(struct pubsubent *psent, topic32 topic, pid32 pid)
+{
+	struct pubshard *sh;
+	struct pubqueue *q;
+	struct publishqueue *ent;
+	uint32 pos;
+
+	// counted like a publication so the topic is not moved while queued
+	__sync_add_and_fetch(&psent->qcount, 1);
+	sh = psshard_of(psent->topic_id);
+	q = &sh->q[psent->prio];
+	while((ent = pubq_reserve(q, &pos)) == NULL) {
+		if(psbroker_self()) {
+			__sync_sub_and_fetch(&psent->qcount, 1);
+			psretain_cancel(psent, pid);
+			return;
+		}
+		pubq_wait(sh, psent, FALSE);
+	}
+	ent->stamp = getticks();
+	ent->topic = topic;
+	ent->psent = psent;
+	ent->conflated = FALSE;
+	ent->replay = pid;
+	ent->data = NULL;
+	ent->size = 0;
+	pubq_commit(q, ent, pos);
+	signal(sh->items);
+}
+
+/*-------------------------------------------------------------------------
+ * psconflate_put - publish to a topic with conflation on. A payload still
+ *                  queued for the topic group is replaced in place, else
+ *                  the cell takes the payload and one entry is queued for
+ *                  it. Same result and buf ownership as pubq_put().
+ *--------------------------------------------------------------------------
+ */
+local status psconflate_put(struct pubsubent *psent, topic32 topic, char *buf, char *data, uint32 size)
+{
+	intmask mask;
+	struct psconflate *cell;
+	char *old;
+	status retval;
+
+	// the cell keeps a reference of its own, the caller's one is dropped on OK
+	if(buf != NULL) {
+		pubbuf_addref(buf, 1);
+	}
+
+	mask = disable();
+	if(psent->conflate == NULL || psent->topic_id != PSTOPIC_ID(topic)) {
+		// pubsub_setconflate() turned conflation off meanwhile, or the
+		// entry was reclaimed - pubq_append() tells
+		restore(mask);
+		if(buf != NULL) {
+			pubbuf_release(buf);
+		}
+		return pubq_append(psent, topic, buf, data, size, FALSE);
+	}
+	cell = &psent->conflate[PSTOPIC_GROUP(topic)];
+	old = cell->data;
+	cell->data = buf;
+	cell->size = size;
+	if(buf == NULL) {
+		memcpy(cell->inl, data, size);
+	}
+	if(cell->queued) {
+		restore(mask);
+		PSSTAT_ADD(conflated, 1);
+		if(old != NULL) {
+			pubbuf_release(old);
+		}
+		if(buf != NULL) {
+			pubbuf_release(buf);
+		}
+		return OK;
+	}
+	cell->queued = TRUE;
+	restore(mask);
+
+	retval = pubq_append(psent, topic, NULL, NULL, 0, TRUE);
+	if(retval != OK) {
+		// drop the cell payload, a publisher that replaced ours meanwhile loses too
+		psconflate_take(psent, topic, NULL);
+	} else if(buf != NULL) {
+		pubbuf_release(buf);
+	}
+	return retval;
+}
+
+/*-------------------------------------------------------------------------
+ * pubq_putent - queue a publication to topic through its topic table
+ *               entry, same result and buf ownership as pubq_put()
+ *--------------------------------------------------------------------------
+ */
+local status pubq_putent(struct pubsubent *psent, topic32 topic, char *buf, char *data, uint32 size)
+{
+	status retval;
+
+	if(psent->conflate != NULL) {
+		retval = psconflate_put(psent, topic, buf, data, size);
+	} else {
+		retval = pubq_append(psent, topic, buf, data, size, FALSE);
+	}
+
+	if(retval == OK) {
+		PSTSTAT_ADD(psent, publishes, 1);
+		PSTSTAT_ADD(psent, bytes, size);
+	} else {
+		PSTSTAT_ADD(psent, drops, 1);
+	}
+	return retval;
+}
+
+/*-------------------------------------------------------------------------
+ * pubq_put - queue a publication for the broker of the topic's shard. A
+ *            topic without table entry has no subscribers or settings,
+ *            its publications are discarded without queueing them.
+ *--------------------------------------------------------------------------
+ */
+local status pubq_put(topic32 topic, char *buf, char *data, uint32 size)
+{
+	struct pubsubent *psent;
+
+	PSTRACE(PSTRACE_MSGS, PSTR_PUBLISH, topic, data, size);
+
+	psent = pstopic_find(PSTOPIC_ID(topic));
+	if(psent == NULL) {
+		PSSTAT_ADD(no_topic, 1);
+		return PUBQ_DISCARD;
+	}
+	return pubq_putent(psent, topic, buf, data, size);
+}
+
+/*-------------------------------------------------------------------------
+ * publish - publish data to a particular group and topic
+ *--------------------------------------------------------------------------
+ */
+syscall publish(topic32 topic, void *data, uint32 size)
+{
+	char *buf;
+	status retval;
+
+	// small payloads are copied into the queue entry itself
+	if(size <= PUBSUB_INLINE_MAX) {
+		retval = pubq_put(topic, NULL, (char *) data, size);
+		return (retval == SYSERR) ? SYSERR : OK;
+	}
+
+	buf = pubbuf_get(size);
+	if(buf == (char *) SYSERR) {
+		return SYSERR;
+	}
+	memcpy(buf, data, size);
+	retval = pubq_put(topic, buf, buf, size);
+	if(retval != OK) {
+		pubbuf_release(buf);
+	}
+	return (retval == SYSERR) ? SYSERR : OK;
+}
+
+/*-------------------------------------------------------------------------
+ * publish_buf - publish a buffer from pubbuf_alloc() without copying it,
+ *               ownership of the caller's reference passes to pubsub
+ *               unless SYSERR is returned
+ *--------------------------------------------------------------------------
+ */
+syscall publish_buf(topic32 topic, char *buf)
+{
+	uint32 size;
+	status retval;
+
+	if(buf == NULL || buf == (char *) SYSERR) {
+		return SYSERR;
+	}
+
+	size = (((struct pubbuf *) buf) - 1)->size;
+
+	if(size <= PUBSUB_INLINE_MAX) {
+		// small payloads travel inline, the buffer is not needed any more
+		retval = pubq_put(topic, NULL, buf, size);
+	} else {
+		retval = pubq_put(topic, buf, buf, size);
+	}
+	if(retval == SYSERR) {
+		return SYSERR;
+	}
+	if(size <= PUBSUB_INLINE_MAX || retval == PUBQ_DISCARD) {
+		pubbuf_release(buf);
+	}
+	return OK;
+}
+
+/*-------------------------------------------------------------------------
+ * publishv - publish n messages in one call. A run of consecutive
+ *            messages bound for the same shard queue gets its queue
+ *            entries with one reservation, and the broker of a shard is
+ *            woken once for the entries queued to it rather than once
+ *            per message. Messages of topics with a queue limit or with
+ *            conflation, and messages finding the queue full, go through
+ *            publish() and its overflow policy. Stops at the first
+ *            message rejected, returns the number of messages accepted
+ *            before it; discarded messages count as accepted, as they
+ *            do for publish().
+ *--------------------------------------------------------------------------
+ */
+syscall publishv(struct pubmsg *msgs, uint32 n)
+{
+	struct pubsubent *run[PUBSUB_PUBV_RUN];
+	char *bufs[PUBSUB_PUBV_RUN];
+	struct pubshard *sh = NULL;
+	struct pubshard *wsh = NULL;	/* shard with entries its broker was not woken for */
+	uint32 wn = 0;
+	struct pubqueue *q = NULL;
+	struct publishqueue *ent;
+	struct pubmsg *m;
+	uint32 count;
+	uint32 pos = 0;
+	uint32 stamp;
+	uint32 got;
+	uint32 i = 0, j = 0, k = 0;
+
+	while(i < n) {
+		// collect a run for one queue, large payloads are copied before
+		// reserving so reserved entries are committed without delay
+		for(k = 0; k < PUBSUB_PUBV_RUN && i + k < n; k++) {
+			m = &msgs[i + k];
+			run[k] = pstopic_find(PSTOPIC_ID(m->topic));
+			// counted before its shard and class are read, like pubq_append()
+			if(run[k] == NULL || pstopic_hold(run[k], PSTOPIC_ID(m->topic)) == 0) {
+				break;
+			}
+			if(run[k]->qlimit != 0 || run[k]->conflate != NULL) {
+				__sync_sub_and_fetch(&run[k]->qcount, 1);
+				break;
+			}
+			if(k == 0) {
+				sh = psshard_of(run[k]->topic_id);
+				q = &sh->q[run[k]->prio];
+			} else if(psshard_of(run[k]->topic_id) != sh || &sh->q[run[k]->prio] != q) {
+				__sync_sub_and_fetch(&run[k]->qcount, 1);
+				break;
+			}
+			bufs[k] = NULL;
+			if(m->size > PUBSUB_INLINE_MAX) {
+				bufs[k] = pubbuf_get(m->size);
+				if(bufs[k] == (char *) SYSERR) {
+					__sync_sub_and_fetch(&run[k]->qcount, 1);
+					break;
+				}
+				memcpy(bufs[k], m->data, m->size);
+			}
+		}
+
+		got = 0;
+		if(k > 0) {
+			count = pubq_count(q);
+			if(count < pubq_limit) {
+				got = pubq_reserven(q, (k < pubq_limit - count) ? k : pubq_limit - count, &pos);
+			}
+			// the queue had no room for the rest of the run
+			for(j = got; j < k; j++) {
+				__sync_sub_and_fetch(&run[j]->qcount, 1);
+				if(bufs[j] != NULL) {
+					pubbuf_release(bufs[j]);
+				}
+			}
+		}
+
+		if(got == 0) {
+			// publish() may wait for the broker, which must see our entries first
+			if(wsh != NULL) {
+				signaln(wsh->items, wn);
+				wsh = NULL;
+				wn = 0;
+			}
+			if(publish(msgs[i].topic, msgs[i].data, msgs[i].size) == SYSERR) {
+				break;
+			}
+			i++;
+			continue;
+		}
+
+		if(wsh != sh) {
+			if(wsh != NULL) {
+				signaln(wsh->items, wn);
+			}
+			wsh = sh;
+			wn = 0;
+		}
+		stamp = getticks();
+		for(j = 0; j < got; j++) {
+			m = &msgs[i + j];
+			PSTRACE(PSTRACE_MSGS, PSTR_PUBLISH, m->topic, m->data, m->size);
+			pubq_qhigh(run[j], run[j]->qcount);
+
+			ent = &q->ring[(pos + j) & q->mask];
+			ent->stamp = stamp;
+			ent->topic = m->topic;
+			ent->psent = run[j];
+			ent->conflated = FALSE;
+			ent->replay = SYSERR;
+			ent->data = bufs[j];
+			ent->size = m->size;
+			if(bufs[j] == NULL && m->size > 0) {
+				memcpy(ent->inl, m->data, m->size);
+			}
+			pubq_commit(q, ent, pos + j);
+
+			PSTSTAT_ADD(run[j], publishes, 1);
+			PSTSTAT_ADD(run[j], bytes, m->size);
+		}
+		wn += got;
+		i += got;
+	}
+
+	if(wsh != NULL) {
+		signaln(wsh->items, wn);
+	}
+	return i;
+}
+
+/*-------------------------------------------------------------------------
+ * pschunk_get - take a message buffer for one stream chunk from the chunk
+ *               pool, waiting for brokers to free one when it is empty.
+ *               Only queued chunks and handlers running hold the pool,
+ *               retained and mailbox payloads are copied out of it.
+ *               Brokers never wait, they get SYSERR instead.
+ *--------------------------------------------------------------------------
+ */
+local char *pschunk_get(uint32 size)
+{
+	intmask mask;
+	struct pubbuf *pbuf;
+
+	if(psbroker_self()) {
+		// take a chunk only if one is free, as pspayload_get() does
+		mask = disable();
+		if(semcount(buftab[pschunk_pool].bpsem) <= 0) {
+			restore(mask);
+			return (char *) SYSERR;
+		}
+		pbuf = (struct pubbuf *) getbuf(pschunk_pool);
+		restore(mask);
+	} else {
+		pbuf = (struct pubbuf *) getbuf(pschunk_pool);
+	}
+	if(pbuf == (struct pubbuf *) SYSERR) {
+		return (char *) SYSERR;
+	}
+	pbuf->magic = PUBBUF_MAGIC;
+	pbuf->refcount = 1;
+	pbuf->size = sizeof(struct pschunk) + size;
+	pbuf->poolid = pschunk_pool;
+	return (char *) (pbuf + 1);
+}
+
+/*-------------------------------------------------------------------------
+ * publish_stream - publish data of any size to a particular group and
+ *                  topic as a stream of chunks of at most PSCHUNK_SIZE
+ *                  bytes from the chunk pool, so no buffer of the full
+ *                  size is needed. Each delivery is one chunk: a struct
+ *                  pschunk followed by its bytes. Subscribers use the
+ *                  chunks as they come or reassemble them with
+ *                  pstream_reasm(). A SYSERR part way leaves receivers
+ *                  with an incomplete stream, which reassembly discards.
+ *--------------------------------------------------------------------------
+ */
+syscall publish_stream(topic32 topic, void *data, uint32 size)
+{
+	struct pschunk *chunk;
+	uint32 stream;
+	uint32 nchunks;
+	uint32 offset = 0;
+	uint32 seq = 0;
+	uint32 n;
+	char *buf;
+	status retval;
+
+	if(pschunk_pool == SYSERR) {
+		return SYSERR;
+	}
+	stream = __sync_fetch_and_add(&psstream_seq, 1);
+	nchunks = (size == 0) ? 1 : (size + PSCHUNK_SIZE - 1) / PSCHUNK_SIZE;
+
+	for(seq = 0; seq < nchunks; seq++) {
+		n = (size - offset < PSCHUNK_SIZE) ? size - offset : PSCHUNK_SIZE;
+		buf = pschunk_get(n);
+		if(buf == (char *) SYSERR) {
+			return SYSERR;
+		}
+		chunk = (struct pschunk *) buf;
+		chunk->stream = stream;
+		chunk->seq = seq;
+		chunk->nchunks = nchunks;
+		chunk->total = size;
+		chunk->offset = offset;
+		chunk->size = n;
+		memcpy(PSCHUNK_DATA(chunk), (char *) data + offset, n);
+
+		retval = pubq_put(topic, buf, buf, sizeof(struct pschunk) + n);
+		if(retval != OK) {
+			pubbuf_release(buf);
+		}
+		if(retval == SYSERR) {
+			return SYSERR;
+		}
+		// nobody listens, the rest would be discarded as well
+		if(retval == PUBQ_DISCARD && seq == 0) {
+			return OK;
+		}
+		PSSTAT_ADD(chunks, 1);
+		offset += n;
+	}
+	return OK;
+}
+
+/*-------------------------------------------------------------------------
+ * pstream_init - set up a subscriber's stream reassembly state
+ *--------------------------------------------------------------------------
+ */
+void pstream_init(struct psreasm *r)
+{
+	r->stream = 0;
+	r->next = 0;
+	r->total = 0;
+	r->buf = NULL;
+	r->done = FALSE;
+	r->lost = 0;
+}
+
+/*-------------------------------------------------------------------------
+ * pstream_reset - free the payload reassembled or being reassembled
+ *--------------------------------------------------------------------------
+ */
+void pstream_reset(struct psreasm *r)
+{
+	if(r->buf != NULL) {
+		freemem(r->buf, (r->total > 0) ? r->total : 1);
+		r->buf = NULL;
+	}
+	r->done = FALSE;
+}
+
+/*-------------------------------------------------------------------------
+ * pstream_reasm - add a chunk delivered to a stream subscriber's handler,
+ *                 returns the whole payload with its size in *total once
+ *                 the last chunk arrived, NULL before. The payload stays
+ *                 valid until the next call or pstream_reset(). A stream
+ *                 missing a chunk is discarded and counted in r->lost.
+ *--------------------------------------------------------------------------
+ */
+char *pstream_reasm(struct psreasm *r, void *data, uint32 size, uint32 *total)
+{
+	struct pschunk *chunk = (struct pschunk *) data;
+
+	// payload handed out by the previous call is no longer needed
+	if(r->done) {
+		pstream_reset(r);
+	}
+	if(size < sizeof(struct pschunk) || chunk->size > size - sizeof(struct pschunk)
+	    || chunk->offset + chunk->size > chunk->total) {
+		return NULL;
+	}
+
+	if(chunk->seq == 0) {
+		if(r->buf != NULL) {
+			r->lost++;
+			pstream_reset(r);
+		}
+		r->buf = getmem((chunk->total > 0) ? chunk->total : 1);
+		if(r->buf == (char *) SYSERR) {
+			r->buf = NULL;
+			r->lost++;
+			return NULL;
+		}
+		r->stream = chunk->stream;
+		r->total = chunk->total;
+		r->next = 0;
+	}
+	if(r->buf == NULL) {
+		return NULL;
+	}
+	if(chunk->stream != r->stream || chunk->seq != r->next) {
+		r->lost++;
+		pstream_reset(r);
+		return NULL;
+	}
+
+	memcpy(r->buf + chunk->offset, PSCHUNK_DATA(chunk), chunk->size);
+	r->next++;
+	if(r->next < chunk->nchunks) {
+		return NULL;
+	}
+	r->done = TRUE;
+	*total = r->total;
+	return r->buf;
+}
+
+/*-------------------------------------------------------------------------
+ * pstopic_pathid - topic id of a path, FNV-1a hash with PSTOPIC_PATHBIT set
+ *--------------------------------------------------------------------------
+ */
+local uint32 pstopic_pathid(char *path)
+{
+	uint32 h = 0x811C9DC5;
+
+	while(*path != '\0') {
+		h = (h ^ (uint8) *path++) * 0x01000193;
+	}
+	// PSTOPIC_PATHSHARED is not the id of any one path
+	h &= PSTOPIC_PATHBIT - 1;
+	if(h == 0) {
+		h = 1;
+	}
+	return PSTOPIC_PATHBIT | h;
+}
+
+/*-------------------------------------------------------------------------
+ * pspath_publish - publish to a path without a topic entry of its own
+ *                  through the shared path entry. The path is stored in
+ *                  the message buffer behind the payload, the broker
+ *                  matches it against the trie for each publication.
+ *--------------------------------------------------------------------------
+ */
+local syscall pspath_publish(char *path, uint32 topic_id, void *data, uint32 size)
+{
+	struct pubsubent *psent;
+	uint32 len = strlen(path) + 1;
+	char *buf;
+	status retval;
+
+	psent = pstopic_find(PSTOPIC_PATHSHARED);
+	if(psent == NULL) {
+		wait(mutex);
+		psent = pstopic_get(PSTOPIC_PATHSHARED);
+		signal(mutex);
+		if(psent == NULL) {
+			return SYSERR;
+		}
+	}
+
+	buf = pubbuf_get(size + len);
+	if(buf == (char *) SYSERR) {
+		return SYSERR;
+	}
+	memcpy(buf, data, size);
+	memcpy(buf + size, path, len);
+
+	// queued as a publication of the shared entry, the broker gives
+	// handlers the topic of the path
+	PSTRACE(PSTRACE_MSGS, PSTR_PUBLISH, PSTOPIC(topic_id, 0), data, size);
+	retval = pubq_putent(psent, PSTOPIC(PSTOPIC_PATHSHARED, 0), buf, buf, size);
+	if(retval != OK) {
+		pubbuf_release(buf);
+	}
+	return (retval == SYSERR) ? SYSERR : OK;
+}
+
+/*-------------------------------------------------------------------------
+ * publish_path - publish data to a path such as sensors/kitchen/temp,
+ *                delivered to subscribe_path() filters matching it and
+ *                to subscribers of the path's topic. Handlers get the
+ *                topic32 of the path, pubsub_path() gives the path back.
+ *                Once PSTOPIC_PATHS paths have a topic entry, other paths
+ *                are only delivered to filters and give no pubsub_path().
+ *--------------------------------------------------------------------------
+ */
+syscall publish_path(char *path, void *data, uint32 size)
+{
+	struct pubsubent *psent;
+	struct pstsub *match;
+	uint32 topic_id;
+	char *copy;
+
+	if(path == NULL) {
+		return SYSERR;
+	}
+	topic_id = pstopic_pathid(path);
+
+	psent = pstopic_find(topic_id);
+	if(psent == NULL || psent->path == NULL) {
+		wait(mutex);
+		// no topic entry is made for paths no filter matches
+		if(psent == NULL && pstrie_match(&pstrie, path, &match, 1) == 0) {
+			signal(mutex);
+			PSSTAT_ADD(no_topic, 1);
+			return OK;
+		}
+		if(psent == NULL && pstopic_paths >= PSTOPIC_PATHS) {
+			signal(mutex);
+			return pspath_publish(path, topic_id, data, size);
+		}
+		psent = pstopic_get(topic_id);
+		if(psent == NULL) {
+			signal(mutex);
+			return SYSERR;
+		}
+		if(psent->path == NULL) {
+			copy = getmem(strlen(path) + 1);
+			if(copy == (char *) SYSERR) {
+				signal(mutex);
+				return SYSERR;
+			}
+			pstopic_paths++;
+			strcpy(copy, path);
+			// path must be complete before lock-free readers see it
+			__sync_synchronize();
+			psent->path = copy;
+		}
+		signal(mutex);
+	}
+
+	// another path hashed to the same topic id
+	if(strcmp(psent->path, path) != 0) {
+		return SYSERR;
+	}
+	return publish(PSTOPIC(topic_id, 0), data, size);
+}
+
+/*-------------------------------------------------------------------------
+ * pubsub_path - path of a topic published with publish_path(), NULL for
+ *               other topics
+ *--------------------------------------------------------------------------
+ */
+char *pubsub_path(topic32 topic)
+{
+	struct pubsubent *psent;
+
+	psent = pstopic_find(PSTOPIC_ID(topic));
+	if(psent == NULL) {
+		return NULL;
+	}
+	return psent->path;
+}
+
+/*-------------------------------------------------------------------------
+ * psmbox_put - queue delivery d of dlv in its subscriber's mailbox, the
+ *              delivery's buffer reference moves with it. Inline payloads
+ *              are copied into the mailbox message, stream chunks to a
+ *              buffer outside the chunk pool. Brokers never wait on a
+ *              mailbox, a message that does not fit is dropped.
+ *--------------------------------------------------------------------------
+ */
+local void psmbox_put(struct pubdelivery *dlv, struct psdlvent *d)
+{
+	intmask mask;
+	struct psmbox *mb;
+	struct psmsg *msg;
+	char *buf = NULL;
+
+	// a chunk must not stay pinned while the subscriber gets to it
+	if(dlv->data != dlv->inl && pschunk_is(dlv->data)) {
+		buf = pubbuf_keep(dlv);
+		pubbuf_release(dlv->data);
+		if(buf == (char *) SYSERR) {
+			PSSTAT_ADD(mbox_dropped, 1);
+			return;
+		}
+	} else if(dlv->data != dlv->inl) {
+		buf = dlv->data;
+	}
+
+	mask = disable();
+	mb = psmbox[d->mbox];
+	if(mb == NULL || mb->owner != d->mbox || mb->tail - mb->head >= PSMBOX_SIZE) {
+		restore(mask);
+		PSSTAT_ADD(mbox_dropped, 1);
+		if(buf != NULL) {
+			pubbuf_release(buf);
+		}
+		return;
+	}
+	msg = &mb->msgs[mb->tail % PSMBOX_SIZE];
+	msg->topic = dlv->topic;
+	msg->handler = d->handler;
+	msg->wide = d->wide;
+	msg->size = dlv->size;
+	msg->inlhdr.magic = 0;
+	msg->data = buf;
+	if(buf == NULL) {
+		memcpy(msg->inl, dlv->inl, dlv->size);
+	}
+	mb->tail++;
+	signal(mb->items);
+	restore(mask);
+	PSSTAT_ADD(mbox_queued, 1);
+}
 
 /*-------------------------------------------------------------------------
- * subscribe - subscribe a function to a particular group and topic
+ * pubsub_receive - wait for the next message in the caller's mailbox and
+ *                  run its handler in the caller's context
  *--------------------------------------------------------------------------
  */
-syscall subscribe(topic16 topic, void (*handler)(topic16, void *, uint32))
+syscall pubsub_receive(void)
 {
-	uint32 topic_id;
-	uint32 group_id;
+	intmask mask;
+	pid32 pid = getpid();
+	struct psmbox *mb = psmbox[pid];
+	struct psmsg msg;
+
+	if(mb == NULL || mb->owner != pid) {
+		return SYSERR;
+	}
+	wait(mb->items);
+
+	mask = disable();
+	memcpy(&msg, &mb->msgs[mb->head % PSMBOX_SIZE], sizeof(struct psmsg));
+	mb->head++;
+	restore(mask);
+
+	if(msg.data == NULL) {
+		pscall(msg.handler, msg.wide, msg.topic, (void *) msg.inl, msg.size);
+	} else {
+		pscall(msg.handler, msg.wide, msg.topic, (void *) msg.data, msg.size);
+		pubbuf_release(msg.data);
+	}
+	return OK;
+}
+
+/*-------------------------------------------------------------------------
+ * psretain_deliver - hand one retained payload to a subscriber that was
+ *                    pending, the reference on buf passes to the delivery
+ *--------------------------------------------------------------------------
+ */
+local void psretain_deliver(struct pubsubfp *psfp, topic32 topic, char *buf)
+{
+	struct pubdelivery dlv;
+	struct psdlvent d;
+
+	dlv.topic = topic;
+	dlv.data = buf;
+	dlv.size = (((struct pubbuf *) buf) - 1)->size;
+	if(!psfilter_match(&psfp->filter, buf, dlv.size)) {
+		PSSTAT_ADD(filtered, 1);
+		pubbuf_release(buf);
+		return;
+	}
+	if(psfp->delivery == PSDLV_MBOX) {
+		d.handler = psfp->handler;
+		d.wide = psfp->wide;
+		d.mbox = psfp->pid;
+		psmbox_put(&dlv, &d);
+		return;
+	}
+	pscall(psfp->handler, psfp->wide, topic, (void *) buf, dlv.size);
+	pubbuf_release(buf);
+}
+
+/*-------------------------------------------------------------------------
+ * psshard_take - take the next entry of a shard in psdrain order, NULL
+ *                when all of its class queues are empty
+ *--------------------------------------------------------------------------
+ */
+local struct publishqueue *psshard_take(struct pubshard *sh, uint32 *lane, uint32 *pos)
+{
+	struct publishqueue *ent;
 	uint32 i = 0;
 
-	topic_id = topic & 0x00FF;
-	group_id = (topic >> 8) & 0x00FF;
+	if(psdrain == PSDRAIN_STRICT) {
+		for(i = 0; i < PSPRIO_CLASSES; i++) {
+			ent = pubq_take(&sh->q[i], pos);
+			if(ent != NULL) {
+				*lane = i;
+				return ent;
+			}
+		}
+		return NULL;
+	}
 
-	wait(mutex);
+	// weighted round robin, an empty class passes its turn to the next one
+	for(i = 0; i <= PSPRIO_CLASSES; i++) {
+		if(sh->credit > 0) {
+			ent = pubq_take(&sh->q[sh->lane], pos);
+			if(ent != NULL) {
+				sh->credit--;
+				*lane = sh->lane;
+				return ent;
+			}
+		}
+		sh->lane = (sh->lane + 1) % PSPRIO_CLASSES;
+		sh->credit = psweight[sh->lane];
+	}
+	return NULL;
+}
 
-	//return error if the process has already subscribed for the topic in some other group
-	for(i = 0; i < MAX_SUBSCRIBER; i++) {
-		if(pubsub[topic_id].psfp_array[i].subscription_state == 1 && pubsub[topic_id].psfp_array[i].pid == getpid()) {
-			return SYSERR;
-			
+/*-------------------------------------------------------------------------
+ * psstat_wait - account ticks an entry of a priority class spent queued
+ *--------------------------------------------------------------------------
+ */
+local void psstat_wait(uint32 lane, uint32 ticks)
+{
+	uint32 max;
+
+	PSSTAT_ADD(prio_taken[lane], 1);
+	PSSTAT_ADD(prio_wait[lane], ticks);
+	while((max = psstats.prio_maxwait[lane]) < ticks) {
+		if(__sync_bool_compare_and_swap(&psstats.prio_maxwait[lane], max, ticks)) {
+			break;
 		}
 	}
+}
+
+/*-------------------------------------------------------------------------
+ * broker - handle publishing queue of a shard to invoke callback function
+ *          with published data to a topic, one broker runs per shard
+ *--------------------------------------------------------------------------
+ */
+process broker(uint32 shard)
+{
+	struct pubshard *sh = &psshard[shard];
+	struct pubsubent *psent;
+	uint32 group_id = 0;
+	uint32 i = 0, j = 0;
+	/* entries dequeued in one pass with their handlers */
+	struct pubdelivery batch[PUBSUB_MAX_BATCH];
+	struct pubdelivery *dlv;
+	struct psdlvent *d;
+	struct publishqueue *ent;
+	uint32 ticks;
+	uint32 lane;
+	uint32 pos;
+	uint32 nbatch = 0;
+	uint32 npopped = 0;
+	/* items counts taken minus entries dequeued, carried across passes */
+	int32 balance = 0;
+	/* retained payloads for a subscriber whose request ended the pass */
+	struct pubsubfp rfp;
+	topic32 rtopics[PSRETAIN_GROUPS * PSRETAIN_MAX];
+	char *rbufs[PSRETAIN_GROUPS * PSRETAIN_MAX];
+	uint32 nreplay = 0;
+	intmask mask;
+
+	sh->pid = getpid();
 	
-	
-	i = 0;
-
-	if( pubsub[topic_id].count < MAX_SUBSCRIBER ) {
-
-		while(i++ < MAX_SUBSCRIBER) {
-			if(pubsub[topic_id].psfp_array[i].subscription_state == 0) {
-				wait(print_mutex);
-				printf("In subscribe. group_id=%d topic_id=%d\n", group_id, topic_id);
-				signal(print_mutex);
-				pubsub[topic_id].psfp_array[i].pid = getpid();
-				pubsub[topic_id].psfp_array[i].handler = handler;
-				pubsub[topic_id].psfp_array[i].subscription_state = 1;
-				pubsub[topic_id].psfp_array[i].group_id = group_id;
-				pubsub[topic_id].count++;
+	while(1) {
+		// sleep until publish() queues an entry. Keep draining without
+		// sleeping while counts are held for entries not dequeued yet, but
+		// sleep after a pass that found nothing: an entry reserved and not
+		// yet committed is signalled by its publisher once it is.
+		if(balance <= 0 || npopped == 0) {
+			wait(sh->items);
+			balance++;
+		}
+
+		// dequeue up to broker_batch entries and snapshot their delivery
+		// lists, mutex keeps the subscription table stable meanwhile
+		nbatch = 0;
+		npopped = 0;
+		sh->ndlv = 0;
+		wait(mutex);
+		psretain_reap();
+		while(nbatch < broker_batch && (ent = psshard_take(sh, &lane, &pos)) != NULL) {
+			npopped++;
+			ticks = getticks() - ent->stamp;
+			psstat_wait(lane, ticks);
+			psent = ent->psent;
+
+			// retained payload request of a new subscriber, its payloads go
+			// out after this batch and before anything dequeued later
+			if(ent->replay != SYSERR) {
+				__sync_sub_and_fetch(&psent->qcount, 1);
+				nreplay = psretain_start(psent, ent->replay, &rfp, rtopics, rbufs);
+				pubq_release(&sh->q[lane], ent, pos);
 				break;
 			}
-			
-		}
+			group_id = PSTOPIC_GROUP(ent->topic);
+
+			// entry discarded by a PSQ_DROPOLD topic limit
+			if(!pubq_live(psent)) {
+				PSTSTAT_ADD(psent, drops, 1);
+				pubq_entdrop(ent);
+				pubq_release(&sh->q[lane], ent, pos);
+				continue;
+			}
+
+			// queue reference to the message buffer moves to broker
+			// a topic is drained by one broker, its dispatch counters need no atomics
+			psent->stats.hwait[pshist_bucket(ticks)]++;
+
+			dlv = &batch[nbatch++];
+			dlv->topic = ent->topic;
+			dlv->psent = psent;
+			dlv->inlhdr.magic = 0;
+			if(ent->conflated) {
+				psconflate_take(psent, ent->topic, dlv);
+			} else {
+				dlv->data = ent->data;
+				dlv->size = ent->size;
+				if(dlv->data == NULL) {
+					memcpy(dlv->inl, ent->inl, dlv->size);
+					dlv->data = dlv->inl;
+				}
+			}
+			pubq_release(&sh->q[lane], ent, pos);
+
+			if(psent->topic_id == PSTOPIC_PATHSHARED) {
+				dlv->topic = PSTOPIC(pstopic_pathid(dlv->data + dlv->size), 0);
+			}
+			PSTRACE(PSTRACE_MSGS, PSTR_DISPATCH, dlv->topic, NULL, 0);
 		
+			psdeliverylist(sh, dlv, psent, group_id);
+			if(psent->path != NULL) {
+				pstrie_deliverylist(sh, dlv, psent, psent->path);
+			} else if(psent->topic_id == PSTOPIC_PATHSHARED) {
+				// path is behind the payload
+				pstrie_deliverylist(sh, dlv, psent, dlv->data + dlv->size);
+			}
+			if(psent->retain > 0) {
+				psretain_put(dlv, psent, group_id);
+			}
+			psent->stats.deliveries += dlv->nhandlers;
+
+			// queue reference becomes one reference per delivery
+			if(dlv->data != dlv->inl && dlv->nhandlers > 1) {
+				pubbuf_addref(dlv->data, dlv->nhandlers - 1);
+			}
+		}
+		signal(mutex);
+
+		if(nbatch > 0) {
+			PSSTAT_ADD(batches, 1);
+			PSSTAT_ADD(batched, nbatch);
+		}
+
+		// room was made, let blocked publishers retry
+		mask = disable();
+		if(sh->waiters > 0) {
+			signaln(sh->room, sh->waiters);
+			sh->waiters = 0;
+		}
+		restore(mask);
+
+		// invoke callbacks without holding mutex so publishers never wait on a handler
+		for(j = 0; j < nbatch; j++) {
+			dlv = &batch[j];
+			for(i = 0; i < dlv->nhandlers; i++) {
+				d = &sh->dlvv[dlv->first + i];
+				// subscriber runs the handler itself
+				if(d->mbox != SYSERR) {
+					psmbox_put(dlv, d);
+					continue;
+				}
+				ticks = getticks();
+				pscall(d->handler, d->wide, dlv->topic, (void *) dlv->data, dlv->size);
+				dlv->psent->stats.hrun[pshist_bucket(getticks() - ticks)]++;
+				if(dlv->data != dlv->inl) {
+					pubbuf_release(dlv->data);
+				}
+			}
+			// nobody subscribed, drop the queue reference
+			if(dlv->data != dlv->inl && dlv->nhandlers == 0) {
+				pubbuf_release(dlv->data);
+			}
+		}
+		for(j = 0; j < nreplay; j++) {
+			psretain_deliver(&rfp, rtopics[j], rbufs[j]);
+		}
+		nreplay = 0;
+
+		// entries dequeued ahead of their counts are paid back by later waits
+		balance -= npopped;
+	}     
+}
+
+/*-------------------------------------------------------------------------
+ * pubsub_setbatch - set max entries broker drains per critical section,
+ *                   0 drains all pending entries up to PUBSUB_MAX_BATCH
+ *--------------------------------------------------------------------------
+ */
+syscall pubsub_setbatch(uint32 n)
+{
+	if(n > PUBSUB_MAX_BATCH) {
+		return SYSERR;
 	}
-	signal(mutex);
+	broker_batch = (n == 0) ? PUBSUB_MAX_BATCH : n;
 	return OK;
 }
 
 /*-------------------------------------------------------------------------
- * unsubscribe - unsubscribe from a particular group and topic
+ * pubsub_setlimit - set capacity of each priority class queue of each
+ *                   shard, at most PUBQ_RING_SIZE, and overflow policy.
+ *                   The limit applies to every queue on its own, up to
+ *                   shards * PSPRIO_CLASSES * limit entries are queued in
+ *                   all.
  *--------------------------------------------------------------------------
  */
-syscall unsubscribe(topic16 topic)
+syscall pubsub_setlimit(uint32 limit, uint32 policy)
 {
-	uint32 topic_id;
-	uint32 group_id;
-	uint32 i = 0;
+	if(limit == 0 || limit > PUBQ_RING_SIZE || policy > PSQ_DROPNEW) {
+		return SYSERR;
+	}
+	pubq_limit = limit;
+	pubq_policy = policy;
+	return OK;
+}
+
+/*-------------------------------------------------------------------------
+ * pubsub_setshards - route topics over the first n shards set up by
+ *                    pubsub_init(). Only allowed while no topic has queued
+ *                    entries or a publisher queueing one, so no topic has
+ *                    entries in two queues. A batch a broker already took
+ *                    may still be delivered after publications routed to
+ *                    the new shard.
+ *--------------------------------------------------------------------------
+ */
+syscall pubsub_setshards(uint32 n)
+{
+	struct pubsubent *psent;
+	intmask mask;
+	uint32 i = 0, j = 0;
+
+	if(n == 0 || n > psnshards) {
+		return SYSERR;
+	}
+	// publishers count an entry in qcount before they look up the shard,
+	// so none can queue to the old shard once every count is seen 0 here
+	mask = disable();
+	for(i = 0; i < PSTOPIC_SLOTS; i++) {
+		psent = pstopics[i];
+		if(psent != NULL && psent->qcount != 0) {
+			restore(mask);
+			return SYSERR;
+		}
+	}
+	for(i = 0; i < psnshards; i++) {
+		for(j = 0; j < PSPRIO_CLASSES; j++) {
+			if(pubq_count(&psshard[i].q[j]) != 0) {
+				restore(mask);
+				return SYSERR;
+			}
+		}
+	}
+	psroute = n;
+	restore(mask);
+	return OK;
+}
 
-	topic_id = topic & 0x00FF;
-	group_id = (topic >> 8) & 0x00FF;
+/*-------------------------------------------------------------------------
+ * pubsub_settopiclimit - set queued entries allowed for one topic and its
+ *                        overflow policy, limit 0 removes the topic limit
+ *--------------------------------------------------------------------------
+ */
+syscall pubsub_settopiclimit(topic32 topic, uint32 limit, uint32 policy)
+{
+	struct pubsubent *psent;
 
+	if(policy > PSQ_DROPNEW) {
+		return SYSERR;
+	}
+	// settings are made under mutex so the entry is not reclaimed meanwhile
 	wait(mutex);
-	while(i++ < MAX_SUBSCRIBER) {
-		if( pubsub[topic_id].psfp_array[i].pid == getpid() && pubsub[topic_id].psfp_array[i].group_id == group_id ) {
-			wait(print_mutex);
-			printf("In unsubscribe. group_id=%d topic_id=%d\n", group_id, topic_id);
-			signal(print_mutex);
-			pubsub[topic_id].psfp_array[i].subscription_state = 0;
-			pubsub[topic_id].count--;
-			break;
+	psent = pstopic_get(PSTOPIC_ID(topic));
+	if(psent == NULL) {
+		signal(mutex);
+		return SYSERR;
+	}
+	psent->qpolicy = policy;
+	psent->qlimit = limit;
+	pstopic_reclaim(psent);
+	signal(mutex);
+	return OK;
+}
+
+/*-------------------------------------------------------------------------
+ * pubsub_settopicprio - set priority class of a topic's publications. Not
+ *                       allowed while the topic has queued entries or a
+ *                       publisher is queueing one, they would be overtaken
+ *                       by the ones queued after them.
+ *--------------------------------------------------------------------------
+ */
+syscall pubsub_settopicprio(topic32 topic, uint32 prio)
+{
+	struct pubsubent *psent;
+	intmask mask;
+
+	if(prio >= PSPRIO_CLASSES) {
+		return SYSERR;
+	}
+	wait(mutex);
+	psent = pstopic_get(PSTOPIC_ID(topic));
+	if(psent == NULL) {
+		signal(mutex);
+		return SYSERR;
+	}
+	// publishers count an entry in qcount before they read prio, so none
+	// can queue to the old class once it is seen to be 0 here
+	mask = disable();
+	if(psent->qcount != 0) {
+		restore(mask);
+		signal(mutex);
+		return SYSERR;
+	}
+	psent->prio = prio;
+	restore(mask);
+	pstopic_reclaim(psent);
+	signal(mutex);
+	return OK;
+}
+
+/*-------------------------------------------------------------------------
+ * pubsub_setdrain - set order broker drains priority classes in. For
+ *                   PSDRAIN_WEIGHTED weights holds the entries each class
+ *                   may give per turn, at least 1.
+ *--------------------------------------------------------------------------
+ */
+syscall pubsub_setdrain(uint32 mode, const uint32 *weights)
+{
+	uint32 i = 0;
+
+	if(mode == PSDRAIN_STRICT) {
+		psdrain = mode;
+		return OK;
+	}
+	if(mode != PSDRAIN_WEIGHTED || weights == NULL) {
+		return SYSERR;
+	}
+	for(i = 0; i < PSPRIO_CLASSES; i++) {
+		if(weights[i] == 0) {
+			return SYSERR;
 		}
 	}
-	signal(mutex);		
-	return OK;	
+	for(i = 0; i < PSPRIO_CLASSES; i++) {
+		psweight[i] = weights[i];
+	}
+	psdrain = mode;
+	return OK;
 }
 
 /*-------------------------------------------------------------------------
- * publish - publish data to a particular group and topic
+ * pubsub_setconflate - turn conflation of a topic on or off. With it on a
+ *                      publication replaces the payload still queued for
+ *                      the same topic group. Not allowed while the topic
+ *                      has queued entries or a publisher is queueing one.
  *--------------------------------------------------------------------------
  */
-syscall publish(topic16 topic, void *data, uint32 size)
+syscall pubsub_setconflate(topic32 topic, bool8 on)
 {
-	wait(mutex);		
+	struct pubsubent *psent;
+	struct psconflate *cells;
+	intmask mask;
+	uint32 i = 0;
 
-	char *data_copy = data;
-	
-	if(publishq->count < max_pub_queue) {
-		int i = 0;
-		wait(print_mutex);
-		printf("In publish. topic=0x%x data: ", topic );
-		for(i = 0; i < size; i++) {
-			printf(" [%d]", data_copy[i]);
+	wait(mutex);
+	psent = pstopic_get(PSTOPIC_ID(topic));
+	if(psent == NULL || psent->qcount != 0) {
+		signal(mutex);
+		return SYSERR;
+	}
+	if(!on) {
+		// publishers use the cells with interrupts disabled and mark a cell
+		// queued before they enable them again, see psconflate_put()
+		mask = disable();
+		cells = psent->conflate;
+		for(i = 0; cells != NULL && i < MAX_GROUP; i++) {
+			if(cells[i].queued) {
+				restore(mask);
+				signal(mutex);
+				return SYSERR;
+			}
+		}
+		psent->conflate = NULL;
+		restore(mask);
+		if(cells != NULL) {
+			freemem((char *) cells, MAX_GROUP * sizeof(struct psconflate));
 		}
-		printf("\n");
-		signal(print_mutex);
-		publishq->pubq[publishq->tail].topic = topic;
+		pstopic_reclaim(psent);
+		signal(mutex);
+		return OK;
+	}
+	if(psent->conflate != NULL) {
+		signal(mutex);
+		return OK;
+	}
+
+	cells = (struct psconflate *) getmem(MAX_GROUP * sizeof(struct psconflate));
+	if(cells == (struct psconflate *) SYSERR) {
+		pstopic_reclaim(psent);
+		signal(mutex);
+		return SYSERR;
+	}
+	for(i = 0; i < MAX_GROUP; i++) {
+		cells[i].queued = FALSE;
+		cells[i].data = NULL;
+	}
+	psent->conflate = cells;
+	signal(mutex);
+	return OK;
+}
+
+/*-------------------------------------------------------------------------
+ * pubsub_setretain - keep the last depth payloads published to each group
+ *                    of a topic, at most PSRETAIN_MAX, for subscribers that
+ *                    come later. Depth 0 drops the retained payloads.
+ *--------------------------------------------------------------------------
+ */
+syscall pubsub_setretain(topic32 topic, uint32 depth)
+{
+	struct pubsubent *psent;
+	struct psretain *rt = NULL;
+	struct psretain *old;
+	uint32 i = 0, j = 0;
 
-		// free existing data array
-		if(publishq->pubq[publishq->tail].size > 0 && publishq->pubq[publishq->tail].data != NULL) {
-			freemem((char *) publishq->pubq[publishq->tail].data, publishq->pubq[publishq->tail].size);
+	if(depth > PSRETAIN_MAX) {
+		return SYSERR;
+	}
+	if(depth > 0) {
+		rt = (struct psretain *) getmem(PSRETAIN_GROUPS * sizeof(struct psretain));
+		if(rt == (struct psretain *) SYSERR) {
+			return SYSERR;
 		}
-		
-		publishq->pubq[publishq->tail].data = (char *) getmem(size);
-		for(i = 0; i < size; i++) {
-			publishq->pubq[publishq->tail].data[i] = data_copy[i];
+		for(i = 0; i < PSRETAIN_GROUPS; i++) {
+			rt[i].count = 0;
+			rt[i].next = 0;
+			rt[i].used = 0;
 		}
-		publishq->pubq[publishq->tail].size = size;
-		
-		publishq->count++;
-		publishq->tail = (publishq->tail + 1) % max_pub_queue;
-	} else {
-		int i = 0;
-		wait(print_mutex);
-		printf("In publish.queue reallocation. topic=0x%x data:", topic);
-		
-		for(i = 0; i < size; i++) {
-			printf(" [%d]", data_copy[i]);
+	}
+
+	wait(mutex);
+	psent = pstopic_get(PSTOPIC_ID(topic));
+	if(psent == NULL) {
+		signal(mutex);
+		if(rt != NULL) {
+			freemem((char *) rt, PSRETAIN_GROUPS * sizeof(struct psretain));
 		}
-		printf("\n");
-		signal(print_mutex);
-		
-		//Current queue size is unable to handle the publishing queue, reallocating
-		struct pubqueue *new_publishq, *tempq;
-		int old_pub_queue_size;
-		old_pub_queue_size = max_pub_queue;
-		max_pub_queue = max_pub_queue * 2; // exponential reallocation
+		return SYSERR;
+	}
+	old = psent->retained;
+	psent->retained = rt;
+	psent->retain = depth;
+	pstopic_reclaim(psent);
+	signal(mutex);
 
-		new_publishq = (struct pubqueue *) getmem(sizeof(struct pubqueue));
-		
-		new_publishq->pubq = (struct publishqueue *) getmem(max_pub_queue * sizeof(struct publishqueue));
-
-		for(i = 0; i < old_pub_queue_size; i++ ) {
-			new_publishq->pubq[i].topic = publishq->pubq[i].topic;
-			new_publishq->pubq[i].data = publishq->pubq[i].data;
-			new_publishq->pubq[i].size = publishq->pubq[i].size;
-		}
-		new_publishq->count = publishq->count;
-		new_publishq->tail = publishq->count;
-		new_publishq->head = publishq->head;
-
-		//Freeing mem for old queue
-		tempq = publishq;
-		publishq = new_publishq;
-		freemem((char *)tempq->pubq, old_pub_queue_size * sizeof(struct publishqueue)); 
-		freemem((char *)tempq, sizeof(struct pubqueue));
-		
-		publishq->pubq[publishq->tail].topic = topic;
-		publishq->pubq[publishq->tail].data = (char *) getmem(size);
-		for(i = 0; i < size; i++) {
-			publishq->pubq[publishq->tail].data[i] = data_copy[i];
+	if(old != NULL) {
+		for(i = 0; i < PSRETAIN_GROUPS; i++) {
+			for(j = 0; j < old[i].count; j++) {
+				pubbuf_release(old[i].bufs[j]);
+			}
 		}
-		publishq->pubq[publishq->tail].size = size;
+		freemem((char *) old, PSRETAIN_GROUPS * sizeof(struct psretain));
+	}
+	return OK;
+}
 
-		publishq->count++;
-		publishq->tail = (publishq->tail + 1) % max_pub_queue;
-		
+/*-------------------------------------------------------------------------
+ * pubsub_getstats - copy pubsub counters, average batch size is
+ *                   batched / batches
+ *--------------------------------------------------------------------------
+ */
+syscall pubsub_getstats(struct pubsubstats *stats)
+{
+	intmask mask;
+
+	if(stats == NULL) {
+		return SYSERR;
 	}
-	signal(mutex);
+	mask = disable();
+	memcpy(stats, &psstats, sizeof(struct pubsubstats));
+	restore(mask);
 	return OK;
-	
 }
 
+/*-------------------------------------------------------------------------
+ * pubsub_topicstats - copy the counters of a topic, SYSERR for a topic
+ *                     not subscribed or set up, whose entry is reclaimed
+ *--------------------------------------------------------------------------
+ */
+syscall pubsub_topicstats(topic32 topic, struct pstopicstats *stats)
+{
+	intmask mask;
+	struct pubsubent *psent;
+
+	if(stats == NULL) {
+		return SYSERR;
+	}
+	psent = pstopic_find(PSTOPIC_ID(topic));
+	if(psent == NULL) {
+		return SYSERR;
+	}
+	mask = disable();
+	memcpy(stats, &psent->stats, sizeof(struct pstopicstats));
+	restore(mask);
+	return OK;
+}
 
 /*-------------------------------------------------------------------------
- * broker - handle publishing queue to invoke callback function with  
- *          published data to a topic
+ * pubsub_topics - store up to max topics in use as group 0 topic32s,
+ *                 returns the number of topics in use
  *--------------------------------------------------------------------------
  */
-process broker()
+uint32 pubsub_topics(topic32 *topics, uint32 max)
 {
-	uint32 topic = 0;
-	uint32 topic_id = 0;
-	uint32 group_id = 0;
-	void *data;
-	uint32 size = 0;
+	struct pubsubent *psent;
+	uint32 n = 0;
 	uint32 i = 0;
-	
-	while(1) {
-		wait(mutex);
-		if(publishq->count > 0) {
-			topic_id = publishq->pubq[publishq->head].topic & 0x00FF;
-			group_id = (publishq->pubq[publishq->head].topic >> 8) & 0x00FF;
-			data = (void *)publishq->pubq[publishq->head].data;
-			size = publishq->pubq[publishq->head].size;
-			publishq->count--;
-			topic = publishq->pubq[publishq->head].topic;
-			publishq->head = (publishq->head + 1) % max_pub_queue;
-			wait(print_mutex);
-			printf("Inside broker. group_id=%d, topic_id=%d\n", group_id, topic_id);
-			signal(print_mutex);
-			
-			// special case
-			if(group_id == 0) {
-				for(i = 0; i < MAX_SUBSCRIBER; i++) {
-					if(pubsub[topic_id].psfp_array[i].subscription_state == 1) {						pubsub[topic_id].psfp_array[i].handler(topic, data, size);
-					}
-				}
-				
-			} else {
-				for(i = 0; i < MAX_SUBSCRIBER; i++) {
-					if(pubsub[topic_id].psfp_array[i].subscription_state == 1 && pubsub[topic_id].psfp_array[i].group_id == group_id) {
-						pubsub[topic_id].psfp_array[i].handler(topic, data, size);
-					}
-				}
 
-			}
-		} 
-		signal(mutex);
-	}     
+	for(i = 0; i < PSTOPIC_SLOTS; i++) {
+		psent = pstopics[i];
+		if(!PSTOPIC_LIVE(psent)) {
+			continue;
+		}
+		if(n < max) {
+			topics[n] = PSTOPIC(psent->topic_id, 0);
+		}
+		n++;
+	}
+	return n;
 }
 
 /*----------------------------------------------------------------------------------------------
  * pubsub_init - initialize global datastructures and variables releated to publisher subscriber
- *               event mechanism
+ *               event mechanism with nshards publishing shards, the caller then creates one
+ *               broker process per shard
  *----------------------------------------------------------------------------------------------
  */
-syscall pubsub_init()
+syscall pubsub_init(uint32 nshards)
 {
 	uint32 i = 0, j = 0;
 
 	printf("In pubsub_init()\n");
+
+	if(nshards == 0 || nshards > PUBSUB_MAX_SHARDS) {
+		return SYSERR;
+	}
 	
-	for(i = 0; i < MAX_TOPIC; i++) {
-		pubsub[i].count = 0;
-		for(j = 0; j < MAX_SUBSCRIBER; j++) {
-			pubsub[i].psfp_array[j].subscription_state = 0;
-		}
+	//topic table entries are allocated as topics are used
+	for(i = 0; i < PSTOPIC_SLOTS; i++) {
+		pstopics[i] = NULL;
+	}
+	pstopic_count = 0;
+	pstopic_free = NULL;
+	pstopic_tomb.topic_id = PSTOPIC_NONE;
+	for(i = 0; i < NPROC; i++) {
+		pssubs[i] = PS_NIL;
+		psmbox[i] = NULL;
+		pstsubs[i] = NULL;
 	}
+	pstrie.name[0] = '\0';
+	pstrie.child = NULL;
+	pstrie.sibling = NULL;
+	pstrie.parent = NULL;
+	pstrie.subs = NULL;
+	pstrie_gen = 1;
+	pstopic_paths = 0;
 
 
 	mutex = semcreate(1);
-	//initial size of publishing queue
-	max_pub_queue = 10; 
 	print_mutex = semcreate(1);
-	
-	//allocate initial memory for dynamic publishing queue
-	publishq = (struct pubqueue *) getmem(sizeof(struct pubqueue));
-	publishq->pubq = (struct publishqueue *) getmem(max_pub_queue * sizeof(struct publishqueue));
-
-	for(i = 0; i < max_pub_queue; i++) {
-		publishq->pubq[i].data = NULL;
-		publishq->pubq[i].size = 0;
+	if(PSTRACE_LEVEL > PSTRACE_OFF && pstrace_init() == SYSERR) {
+		return SYSERR;
 	}
+	broker_batch = PUBSUB_MAX_BATCH;
+	pubq_limit = PUBQ_RING_SIZE;
+	pubq_policy = PSQ_BLOCK;
+	psdrain = PSDRAIN_STRICT;
+	psretain_seq = 0;
+	for(i = 0; i < PSPRIO_CLASSES; i++) {
+		psweight[i] = 1 << (PSPRIO_CLASSES - 1 - i);
+	}
+	memset(&psstats, 0, sizeof(struct pubsubstats));
 
+	//payload pools for each size class
+	for(i = 0; i < PSPOOL_CLASSES; i++) {
+		pspool[i] = mkbufpool(pspool_bufsize[i], pspool_nbufs[i]);
+	}
+	//stream chunks, each with its message buffer and chunk header
+	pschunk_pool = mkbufpool(sizeof(struct pubbuf) + sizeof(struct pschunk) + PSCHUNK_SIZE, PSCHUNK_NBUFS);
+	psstream_seq = 0;
 	
-	publishq->head = 0;
-	publishq->count = 0;
-	publishq->tail = 0;
+	//publishing shards, each class queue preallocated to its full capacity of
+	//PUBQ_RING_SIZE entries, which stays allocated after a burst drains
+	psshard = (struct pubshard *) getmem(nshards * sizeof(struct pubshard));
+	if(psshard == (struct pubshard *) SYSERR) {
+		return SYSERR;
+	}
+	for(i = 0; i < nshards; i++) {
+		for(j = 0; j < PSPRIO_CLASSES; j++) {
+			if(pubq_init(&psshard[i].q[j], PUBQ_RING_SIZE) == SYSERR) {
+				return SYSERR;
+			}
+		}
+		psshard[i].lane = 0;
+		psshard[i].credit = psweight[0];
+		psshard[i].items = semcreate(0);
+		psshard[i].room = semcreate(0);
+		psshard[i].waiters = 0;
+		psshard[i].pid = SYSERR;
+		psshard[i].dlvv = (struct psdlvent *) getmem(PSDLV_MINENTS * sizeof(struct psdlvent));
+		if(psshard[i].dlvv == (struct psdlvent *) SYSERR) {
+			return SYSERR;
+		}
+		psshard[i].dlvmax = PSDLV_MINENTS;
+		psshard[i].ndlv = 0;
+	}
+	psnshards = nshards;
+	psroute = nshards;
 		
 	return OK;
 }
 	
 
 /*-------------------------------------------------------------------------------------------------
- * unsubscribe_pub_sub - when the process gets over unsubscribe from all topics of process
+ * unsubscribe_pub_sub - when the process gets over unsubscribe from all topics of process,
+ *                       only the subscriptions on its own list are visited
  *-------------------------------------------------------------------------------------------------
  */
 syscall unsubscribe_pub_sub(pid32 pid) 
 {
-	int i = 0, j = 0;
-	
-	for(i = 0; i < MAX_TOPIC; i++) {
-		for(j = 0; j < MAX_SUBSCRIBER; j++) {
-			if(pubsub[i].psfp_array[j].subscription_state == 1 && pubsub[i].psfp_array[j].pid == pid) {
-				unsubscribe( ( (pubsub[i].psfp_array[j].group_id << 8) + i ) );
-			}
-		}
+	struct pubsubent *psent;
+	intmask mask;
+	struct psmbox *mb;
+	int32 ref;
+
+	// nothing to do for processes that never subscribed
+	if(pssubs[pid] == PS_NIL && pstsubs[pid] == NULL && (psmbox[pid] == NULL || psmbox[pid]->owner != pid)) {
+		return OK;
+	}
+
+	wait(mutex);
+	while((ref = pssubs[pid]) != PS_NIL) {
+		psent = pstopics[PSREF_TOPIC(ref)];
+		psunsub(psent, PSREF_SLOT(ref));
+		pstopic_reclaim(psent);
+	}
+	while(pstsubs[pid] != NULL) {
+		pstsub_drop(pstsubs[pid]);
 	}
+	signal(mutex);
 
+	// empty the mailbox, brokers still holding a delivery for pid drop it
+	mb = psmbox[pid];
+	if(mb == NULL) {
+		return OK;
+	}
+	mask = disable();
+	mb->owner = SYSERR;
+	for(; mb->head != mb->tail; mb->head++) {
+		if(mb->msgs[mb->head % PSMBOX_SIZE].data != NULL) {
+			pubbuf_release(mb->msgs[mb->head % PSMBOX_SIZE].data);
+		}
+	}
+	// a process blocked in pubsub_receive() is taken off items by kill()
+	if(proctab[pid].prstate != PR_WAIT || proctab[pid].prsem != mb->items) {
+		semreset(mb->items, 0);
+	}
+	restore(mask);
+	return OK;
 }
 
 
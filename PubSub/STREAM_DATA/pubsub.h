@@ -1,34 +1,381 @@
 /* pubsub.h */
 
-#define MAX_SUBSCRIBER 8
+/* subscribers of one topic - a process subscribes to a topic once */
+#define MAX_SUBSCRIBER NPROC
+/* subscriber slots allocated on first subscribe to a topic, the vector
+   doubles when full and halves when at most a quarter is in use */
+#define PSFP_MINSLOTS 4
+/* delivery list entries each broker starts with, grown as needed */
+#define PSDLV_MINENTS (PUBSUB_MAX_BATCH * PSFP_MINSLOTS)
 #define MAX_GROUP 256
+/* topic ids a topic16 can name */
 #define MAX_TOPIC 256
+/* topic table slots, power of 2 - at most PSTOPIC_MAX topics are in use */
+#define PSTOPIC_SLOTS 512
+#define PSTOPIC_MAX (PSTOPIC_SLOTS * 3 / 4)
+/* topic id of reclaimed entries and of the slots they leave, no topic32
+   has it. PSTOPIC_LIVE() tells entries in use from empty and reclaimed slots. */
+#define PSTOPIC_NONE 0xFFFFFFFF
+#define PSTOPIC_LIVE(e)		((e) != NULL && (e)->topic_id != PSTOPIC_NONE)
+/* topic32 fields - topic id bits 0..7 and 16..31, group id bits 8..15 */
+#define PSTOPIC_ID(t)		(((t) & 0x00FF) | (((t) >> 8) & 0x00FFFF00))
+#define PSTOPIC_GROUP(t)	(((t) >> 8) & 0x00FF)
+#define PSTOPIC(id, group)	(((id) & 0x00FF) | (((group) & 0x00FF) << 8) | (((id) & 0x00FFFF00) << 8))
+/* words in per-topic bitmap of subscribed processes */
+#define PS_PIDWORDS ((NPROC + 31) / 32)
+/* buckets of per-topic group index, power of 2 */
+#define PS_GROUPHASH 16
+/* end of a subscriber index list */
+#define PS_NIL (-1)
+/* reference to subscriber slot s of topic table slot t, used by per-process lists */
+#define PSREF(t, s)	((s) * PSTOPIC_SLOTS + (t))
+#define PSREF_TOPIC(r)	((r) % PSTOPIC_SLOTS)
+#define PSREF_SLOT(r)	((r) / PSTOPIC_SLOTS)
+/* max publications broker dequeues in one critical section */
+#define PUBSUB_MAX_BATCH 16
+/* max publications publishv() reserves queue entries for at once */
+#define PUBSUB_PUBV_RUN 16
+/* payload pool size classes, poolid of payloads allocated from heap */
+#define PSPOOL_CLASSES 3
+#define PSPOOL_HEAP (-1)
+/* payloads up to this size are stored inline in publishing queue entry */
+#define PUBSUB_INLINE_MAX 24
+/* struct pubbuf magic, tells message buffers from the inline payload copies
+   handlers get, which are preceded by a header without it */
+#define PUBBUF_MAGIC 0x50554246
+/* streamed payloads - bytes per chunk, and chunks in the pool bounding
+   the memory of stream data queued or being delivered */
+#define PSCHUNK_SIZE 256
+#define PSCHUNK_NBUFS 32
+/* entries in the lock-free ring of each priority class queue of each shard,
+   power of 2. The rings are allocated by pubsub_init() and never shrink:
+   PUBSUB_SHARDS * PSPRIO_CLASSES * PUBQ_RING_SIZE queue entries in all.
+   pubsub_setlimit() caps each class queue of each shard, not the system. */
+#define PUBQ_RING_SIZE 128
+/* broker shards - topics are spread over them by topic_id */
+#define PUBSUB_MAX_SHARDS 8
+/* shards set up at boot, one broker process each */
+#define PUBSUB_SHARDS 4
+
+/* priority classes, each with its own queue in every shard - 0 most urgent */
+#define PSPRIO_CLASSES	3
+#define PSPRIO_HIGH	0	/* control messages */
+#define PSPRIO_NORMAL	1	/* default class of a topic */
+#define PSPRIO_BULK	2	/* stream data */
+
+/* order in which broker drains the priority class queues */
+#define PSDRAIN_STRICT		0	/* most urgent non-empty class first */
+#define PSDRAIN_WEIGHTED	1	/* up to weight entries of each class in turn */
+
+/* delivery modes of a subscription */
+#define PSDLV_BROKER	0	/* handler runs in the broker process */
+#define PSDLV_MBOX	1	/* broker queues the message in subscriber's mailbox */
+/* messages a subscriber mailbox holds */
+#define PSMBOX_SIZE 32
+
+/* content filter operations, see subscribe_filter() */
+#define PSF_ALL		0	/* every publication passes */
+#define PSF_RANGE	1	/* lo <= field <= hi */
+#define PSF_MASK	2	/* (field & mask) == match */
+
+/* payloads retained per group of a topic, groups retained per topic */
+#define PSRETAIN_MAX	4
+#define PSRETAIN_GROUPS	4
+
+/* trace verbosity, fixed at compile time - trace calls above it compile
+   to nothing, with PSTRACE_OFF there is no trace ring or logger either */
+#define PSTRACE_OFF	0
+#define PSTRACE_SUBS	1	/* subscribe and unsubscribe */
+#define PSTRACE_MSGS	2	/* also every publish and broker dispatch */
+#ifndef PSTRACE_LEVEL
+#define PSTRACE_LEVEL	PSTRACE_MSGS
+#endif
+/* trace ring records, power of 2 - events that find it full are lost */
+#define PSTRACE_SIZE	256
+/* payload or filter bytes kept in a trace record */
+#define PSTRACE_DATA	16
+/* priority of the logger process and its poll interval when idle */
+#define PSTRACE_PRIO	5
+#define PSTRACE_POLL_MS	50
+
+/* trace events */
+#define PSTR_SUBSCRIBE		0
+#define PSTR_UNSUBSCRIBE	1
+#define PSTR_SUBPATH		2
+#define PSTR_UNSUBPATH		3
+#define PSTR_PUBLISH		4
+#define PSTR_DISPATCH		5
+
+/* record a trace event of the given level */
+#define PSTRACE(level, event, topic, data, size)			\
+	do {								\
+		if((level) <= PSTRACE_LEVEL) {				\
+			pstrace_put((event), (topic), (data), (size));	\
+		}							\
+	} while(0)
+
+/* log2 buckets of per-topic histograms - bucket 0 counts 0, bucket i
+   counts 2^(i-1) up to 2^i - 1, the last one everything above */
+#define PSHIST_BUCKETS 16
+
+/* longest level of a subscription filter, '\0' included */
+#define PSTRIE_NAMELEN 16
+/* topic id bit of topics named by a path, see publish_path() */
+#define PSTOPIC_PATHBIT 0x00800000
+/* paths given a topic table entry of their own, so paths cannot take the
+   table from numeric topics. Publications to further paths share the entry
+   of PSTOPIC_PATHSHARED and carry their path behind the payload. */
+#define PSTOPIC_PATHS (PSTOPIC_MAX / 4)
+#define PSTOPIC_PATHSHARED PSTOPIC_PATHBIT
+
+/* overflow policies when publishing queue or a topic is at its limit */
+#define PSQ_BLOCK	0	/* publisher waits for broker to make room */
+#define PSQ_REJECT	1	/* publish returns SYSERR */
+#define PSQ_DROPOLD	2	/* oldest queued entry (of the topic) is discarded */
+#define PSQ_DROPNEW	3	/* new publication is discarded, publish returns OK */
+
+//payload test broker applies before delivering to a subscriber
+struct psfilter {
+	uint8 op;	/* PSF_ALL, PSF_RANGE or PSF_MASK */
+	uint8 offset;	/* payload byte the field starts at */
+	uint8 width;	/* field bytes - 1, 2 or 4, little endian unsigned */
+	uint32 a;	/* PSF_RANGE lo, PSF_MASK mask */
+	uint32 b;	/* PSF_RANGE hi, PSF_MASK match */
+};
 
 //entry for pubsub function pointer
 struct pubsubfp {
 	pid32 pid;
 	uint32 group_id;
-	void (*handler)(topic16, void *, uint32);
+	void (*handler)(topic16, void *, uint32);	/* topic32 handler when wide */
+	bool8 wide;		/* subscribed with subscribe32() */
 	uint32 subscription_state;
+	uint32 delivery;	/* PSDLV_BROKER or PSDLV_MBOX */
+	struct psfilter filter;	/* publications the subscriber wants */
+	bool8 pending;		/* waits for retained payloads, broker skips it */
+	int32 gnext;	/* next slot on the same group list, or on the free list */
+	int32 gprev;	/* previous slot on the same group list */
+	int32 pnext;	/* next PSREF() subscription of the same process */
+	int32 pprev;	/* previous PSREF() subscription of the same process */
 };
 
-// topic table entry
+//per-topic counters, see pubsub_topicstats()
+struct pstopicstats {
+	uint32 publishes;	/* publications accepted */
+	uint32 deliveries;	/* handler calls and mailbox messages */
+	uint32 drops;		/* publications rejected or discarded */
+	uint32 bytes;		/* payload bytes accepted */
+	uint32 qhigh;		/* most entries of the topic queued at once */
+	uint32 hwait[PSHIST_BUCKETS];	/* ticks from publish to broker dispatch */
+	uint32 hrun[PSHIST_BUCKETS];	/* ticks a handler ran in the broker */
+};
+
+// topic table entry, allocated when a topic is first used
 struct pubsubent {
-	struct pubsubfp psfp_array[MAX_SUBSCRIBER];
+	uint32 topic_id;	/* key of the entry, PSTOPIC_NONE once reclaimed */
+	uint32 index;		/* topic table slot, see PSREF() */
+	struct pubsubent *fnext;	/* next reclaimed entry to reuse */
+	struct pubsubfp *psfp_array;	/* nslots subscriber slots, NULL when none */
+	uint32 nslots;
 	uint32 count;
+	int32 ghash[PS_GROUPHASH];	/* group lists, keyed by group_id */
+	int32 wildcard;			/* list of group 0 subscribers */
+	int32 freelist;			/* free subscriber slots */
+	uint32 pidmap[PS_PIDWORDS];	/* set bit - process subscribed to the topic */
+	uint32 rdrop[PS_PIDWORDS];	/* set bit - retained request of the process dropped */
+	uint32 qcount;	/* entries of this topic in publishing queue */
+	uint32 qdrop;	/* oldest entries broker discards for PSQ_DROPOLD */
+	uint32 qlimit;	/* max queued entries, 0 - only system limit applies */
+	uint32 qpolicy;	/* overflow policy when qlimit is reached */
+	uint32 prio;	/* priority class of the topic's publications */
+	uint32 retain;	/* payloads retained per group, 0 - none */
+	struct psretain *retained;	/* PSRETAIN_GROUPS records when retain > 0 */
+	struct psconflate *conflate;	/* MAX_GROUP cells when conflation is on */
+	char *path;	/* path of a PSTOPIC_PATHBIT topic, NULL otherwise */
+	struct pstsub **tmatch;	/* cached filter subscriptions matching path */
+	uint32 tmatchmax;	/* tmatch entries allocated */
+	uint32 ntmatch;		/* tmatch entries in use */
+	uint32 tmatchgen;	/* pstrie_gen tmatch was computed for */
+	char *tpath;	/* path tmatch was computed for when path is NULL */
+	struct pstopicstats stats;
+};
+
+//level of the subscription trie, see pubtrie.c
+struct pstnode {
+	char name[PSTRIE_NAMELEN];	/* level, "+" or "#" for wildcards */
+	struct pstnode *child;		/* first of the next level nodes */
+	struct pstnode *sibling;	/* next node of the same level */
+	struct pstnode *parent;		/* node of the level above, NULL for the root */
+	struct pstsub *subs;		/* subscriptions whose filter ends here */
+};
+
+//subscription to a topic filter, see subscribe_path()
+struct pstsub {
+	struct pstsub *next;	/* next subscription of the same node */
+	struct pstnode *node;	/* node the filter ends at */
+	struct pstsub *pnext;	/* next filter subscription of the same process */
+	pid32 pid;
+	void (*handler)(topic32, void *, uint32);
+};
+
+//newest payload of a topic group with conflation on, see pubsub_setconflate()
+struct psconflate {
+	bool8 queued;	/* a publishing queue entry refers to the cell */
+	char *data;	/* message buffer reference, NULL when payload is in inl */
+	uint32 size;
+	char inl[PUBSUB_INLINE_MAX];
+};
+
+//payloads retained for one group of a topic, see pubsub_setretain()
+struct psretain {
+	uint32 group_id;
+	uint32 count;	/* payloads kept, at most the topic's retain depth */
+	uint32 next;	/* bufs index the next payload is kept at */
+	uint32 used;	/* update sequence, least recently used record is reused */
+	char *bufs[PSRETAIN_MAX];	/* message buffer references */
+};
+
+//message buffer header, payload follows it - see pubbuf_alloc()
+struct pubbuf {
+	uint32 magic;		/* PUBBUF_MAGIC while the buffer is allocated */
+	uint32 refcount;	/* queue entries and deliveries using it */
+	uint32 size;		/* payload bytes */
+	bpid32 poolid;		/* payload pool or PSPOOL_HEAP */
+};
+
+//header of each chunk of a payload published with publish_stream(), the
+//chunk's payload bytes follow it - see PSCHUNK_DATA()
+struct pschunk {
+	uint32 stream;	/* stream number, one per publish_stream() call */
+	uint32 seq;	/* chunk number, 0 first */
+	uint32 nchunks;	/* chunks the payload was split into */
+	uint32 total;	/* payload bytes */
+	uint32 offset;	/* payload byte the chunk starts at */
+	uint32 size;	/* payload bytes in this chunk */
+};
+#define PSCHUNK_DATA(c)	((char *) ((c) + 1))
+
+//reassembly state of a stream subscriber, see pstream_reasm()
+struct psreasm {
+	uint32 stream;	/* stream being reassembled */
+	uint32 next;	/* chunk number expected next */
+	uint32 total;	/* payload bytes of the stream */
+	char *buf;	/* getmem() block for the payload, NULL when idle */
+	bool8 done;	/* buf holds a complete payload handed out last call */
+	uint32 lost;	/* streams discarded for a missing chunk */
+};
+
+//one publication of a publishv() batch
+struct pubmsg {
+	topic32 topic;
+	void *data;
+	uint32 size;
 };
 
 //publishing queue entry
 struct publishqueue {
-	topic16 topic;
-	char *data;	
+	uint32 seq;	/* ring position the entry is free or filled for */
+	uint32 stamp;	/* getticks() when queued, for class wait counters */
+	topic32 topic;
+	struct pubsubent *psent;	/* topic table entry of topic */
+	bool8 conflated;	/* payload is in the topic's conflation cell */
+	pid32 replay;	/* subscriber to hand retained payloads to, SYSERR for a publication */
+	char *data;	/* message buffer, NULL when payload is in inl */
 	uint32 size;
+	char inl[PUBSUB_INLINE_MAX];
 };
 
-//publishing queue
+//lock-free publishing queue, see pubring.c
 struct pubqueue {
-	struct publishqueue *pubq;
-	uint32 head;
-	uint32 tail;
-	uint32 count;	
+	struct publishqueue *ring;
+	uint32 mask;		/* ring size - 1 */
+	volatile uint32 head;	/* next position to take */
+	volatile uint32 tail;	/* next position to reserve */
+};
+
+//publishing shard - one queue per priority class and the broker draining them
+struct pubshard {
+	struct pubqueue q[PSPRIO_CLASSES];	/* publications of the shard's topics */
+	sid32 items;		/* counts entries in all q - broker blocks on it */
+	sid32 room;		/* publishers blocked on a full queue wait here */
+	uint32 waiters;		/* publishers waiting on room */
+	pid32 pid;		/* broker process, never blocked by PSQ_BLOCK */
+	uint32 lane;		/* class being drained by PSDRAIN_WEIGHTED */
+	uint32 credit;		/* entries lane may still give in this turn */
+	struct psdlvent *dlvv;	/* delivery lists of the broker's current batch */
+	uint32 dlvmax;		/* dlvv entries allocated */
+	uint32 ndlv;		/* dlvv entries in use */
+};
+
+//publication dequeued by broker along with its delivery list
+struct pubdelivery {
+	topic32 topic;
+	struct pubsubent *psent;
+	char *data;	/* message buffer or inl */
+	uint32 size;
+	struct pubbuf inlhdr;	/* never PUBBUF_MAGIC, makes inl fail pubbuf_hold() */
+	char inl[PUBSUB_INLINE_MAX];
+	uint32 first;	/* first delivery list entry in the shard's dlvv */
+	uint32 nhandlers;
+};
+
+//subscriber a dequeued publication is delivered to
+struct psdlvent {
+	void (*handler)(topic16, void *, uint32);
+	bool8 wide;	/* handler takes a topic32 */
+	pid32 mbox;	/* mailbox owner, SYSERR - call in broker */
+};
+
+//message waiting in a subscriber mailbox
+struct psmsg {
+	topic32 topic;
+	void (*handler)(topic16, void *, uint32);
+	bool8 wide;	/* handler takes a topic32 */
+	char *data;	/* message buffer reference, NULL when payload is in inl */
+	uint32 size;
+	struct pubbuf inlhdr;	/* never PUBBUF_MAGIC, makes inl fail pubbuf_hold() */
+	char inl[PUBSUB_INLINE_MAX];
+};
+
+//subscriber mailbox, filled by brokers and drained by pubsub_receive()
+struct psmbox {
+	struct psmsg msgs[PSMBOX_SIZE];
+	uint32 head;	/* next message to receive */
+	uint32 tail;	/* next free message */
+	sid32 items;	/* counts queued messages - subscriber blocks on it */
+	pid32 owner;	/* process receiving from it, SYSERR once killed */
+};
+
+//trace record, see pubtrace.c
+struct pstrace {
+	uint32 seq;	/* ring position the record is free or filled for */
+	uint32 stamp;	/* getticks() of the event */
+	pid32 pid;	/* process the event happened in */
+	uint32 event;	/* PSTR_* */
+	topic32 topic;
+	uint32 size;	/* full length of the payload or filter */
+	char data[PSTRACE_DATA];	/* its first bytes */
+};
+
+//pubsub counters
+struct pubsubstats {
+	uint32 batches;		/* critical sections in which broker dequeued entries */
+	uint32 batched;		/* entries dequeued over all batches */
+	uint32 pool_hits;	/* payloads allocated from a pool */
+	uint32 pool_misses;	/* fitting pool was exhausted */
+	uint32 heap_allocs;	/* payloads allocated with getmem */
+	uint32 blocked;		/* publisher waits for queue room */
+	uint32 rejected;	/* publications refused with SYSERR */
+	uint32 dropped_old;	/* queued entries discarded for newer ones */
+	uint32 dropped_new;	/* new publications discarded */
+	uint32 no_topic;	/* publications to topics never subscribed or set up */
+	uint32 conflated;	/* queued payloads replaced by a newer one */
+	uint32 chunks;		/* stream chunks queued by publish_stream() */
+	uint32 mbox_queued;	/* messages queued in subscriber mailboxes */
+	uint32 mbox_dropped;	/* messages lost to a full or missing mailbox */
+	uint32 filtered;	/* deliveries skipped by subscriber content filters */
+	uint32 dlv_nomem;	/* deliveries lost for want of memory to list them */
+	uint32 prio_taken[PSPRIO_CLASSES];	/* entries broker took from each class */
+	uint32 prio_wait[PSPRIO_CLASSES];	/* ticks those entries spent queued */
+	uint32 prio_maxwait[PSPRIO_CLASSES];	/* longest ticks one entry was queued */
 };
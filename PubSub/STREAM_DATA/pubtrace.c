@@ -0,0 +1,167 @@
+/* pubtrace.c - pstrace_init, pstrace_put, pstrace_logger */
+#include <xinu.h>
+
+/*-------------------------------------------------------------------------
+ * Pubsub trace log
+ *
+ * Subscribe, unsubscribe, publish and broker leave binary records in a
+ * ring instead of printing. Producers reserve records with a compare-and-
+ * swap on the tail and mark them filled through their sequence number,
+ * as in pubring.c, and never wait: a record that finds the ring full is
+ * counted as lost. The low-priority logger process is the only consumer,
+ * it formats the records on the console when the system is otherwise
+ * idle. What is recorded is fixed by PSTRACE_LEVEL at compile time.
+ *--------------------------------------------------------------------------
+ */
+
+extern sid32 print_mutex;
+
+/* trace ring, PSTRACE_SIZE records */
+struct pstrace *pstrace_ring;
+/* next position the logger formats and next position to reserve */
+uint32 pstrace_head;
+uint32 pstrace_tail;
+/* records lost to a full ring */
+uint32 pstrace_lost;
+
+/*-------------------------------------------------------------------------
+ * pstrace_init - allocate the trace ring
+ *--------------------------------------------------------------------------
+ */
+status pstrace_init(void)
+{
+	uint32 i = 0;
+
+	pstrace_ring = (struct pstrace *) getmem(PSTRACE_SIZE * sizeof(struct pstrace));
+	if(pstrace_ring == (struct pstrace *) SYSERR) {
+		return SYSERR;
+	}
+	for(i = 0; i < PSTRACE_SIZE; i++) {
+		pstrace_ring[i].seq = i;
+	}
+	pstrace_head = 0;
+	pstrace_tail = 0;
+	pstrace_lost = 0;
+	return OK;
+}
+
+/*-------------------------------------------------------------------------
+ * pstrace_put - record a trace event with up to PSTRACE_DATA bytes of
+ *               data, size is the full length of data
+ *--------------------------------------------------------------------------
+ */
+void pstrace_put(uint32 event, topic32 topic, char *data, uint32 size)
+{
+	struct pstrace *rec;
+	uint32 tail;
+	int32 dif;
+
+	tail = pstrace_tail;
+	while(1) {
+		rec = &pstrace_ring[tail & (PSTRACE_SIZE - 1)];
+		dif = (int32) (rec->seq - tail);
+		if(dif == 0) {
+			if(__sync_bool_compare_and_swap(&pstrace_tail, tail, tail + 1)) {
+				break;
+			}
+		} else if(dif < 0) {
+			// logger has not caught up, the event is lost
+			__sync_fetch_and_add(&pstrace_lost, 1);
+			return;
+		}
+		tail = pstrace_tail;
+	}
+
+	rec->stamp = getticks();
+	rec->pid = getpid();
+	rec->event = event;
+	rec->topic = topic;
+	rec->size = size;
+	if(data != NULL) {
+		memcpy(rec->data, data, (size < PSTRACE_DATA) ? size : PSTRACE_DATA);
+	}
+
+	// record contents must be visible before its sequence number
+	__sync_synchronize();
+	rec->seq = tail + 1;
+}
+
+/*-------------------------------------------------------------------------
+ * pstrace_print - format one trace record, print_mutex held
+ *--------------------------------------------------------------------------
+ */
+local void pstrace_print(struct pstrace *rec)
+{
+	uint32 n = (rec->size < PSTRACE_DATA) ? rec->size : PSTRACE_DATA;
+	uint32 i = 0;
+
+	switch(rec->event) {
+	case PSTR_SUBSCRIBE:
+		printf("In subscribe. group_id=%d topic_id=%d\n",
+			PSTOPIC_GROUP(rec->topic), PSTOPIC_ID(rec->topic));
+		break;
+
+	case PSTR_UNSUBSCRIBE:
+		printf("In unsubscribe. group_id=%d topic_id=%d\n",
+			PSTOPIC_GROUP(rec->topic), PSTOPIC_ID(rec->topic));
+		break;
+
+	case PSTR_SUBPATH:
+	case PSTR_UNSUBPATH:
+		printf("In %s. filter=", (rec->event == PSTR_SUBPATH) ? "subscribe_path" : "unsubscribe_path");
+		for(i = 0; i < n; i++) {
+			printf("%c", rec->data[i]);
+		}
+		printf("%s\n", (rec->size > n) ? "..." : "");
+		break;
+
+	case PSTR_PUBLISH:
+		printf("In publish. topic=0x%x data: ", rec->topic);
+		for(i = 0; i < n; i++) {
+			printf(" [%d]", rec->data[i]);
+		}
+		printf("%s\n", (rec->size > n) ? " ..." : "");
+		break;
+
+	case PSTR_DISPATCH:
+		printf("Inside broker. group_id=%d, topic_id=%d\n",
+			PSTOPIC_GROUP(rec->topic), PSTOPIC_ID(rec->topic));
+		break;
+	}
+}
+
+/*-------------------------------------------------------------------------
+ * pstrace_logger - format trace records on the console, runs at
+ *                  PSTRACE_PRIO so tracing never delays pubsub work
+ *--------------------------------------------------------------------------
+ */
+process pstrace_logger(void)
+{
+	struct pstrace *rec;
+	uint32 lost = 0;
+
+	while(1) {
+		rec = &pstrace_ring[pstrace_head & (PSTRACE_SIZE - 1)];
+		if(rec->seq != pstrace_head + 1) {
+			if(pstrace_lost != lost) {
+				wait(print_mutex);
+				printf("pubsub trace: %d records lost\n", pstrace_lost - lost);
+				signal(print_mutex);
+				lost = pstrace_lost;
+			}
+			sleepms(PSTRACE_POLL_MS);
+			continue;
+		}
+		__sync_synchronize();
+
+		wait(print_mutex);
+		pstrace_print(rec);
+		signal(print_mutex);
+
+		// hand the record back to producers for the next lap
+		__sync_synchronize();
+		rec->seq = pstrace_head + PSTRACE_SIZE;
+		pstrace_head++;
+	}
+	return OK;
+}
@@ -0,0 +1,233 @@
+/* pubtrie.c - pstrie_insert, pstrie_remove, pstrie_find, pstrie_match */
+#include <xinu.h>
+
+/*-------------------------------------------------------------------------
+ * Subscription trie
+ *
+ * Hierarchical topic filters are split at '/' into levels and stored one
+ * level per node. A level of a filter may be "+", matching any single
+ * level of a path, or a final "#", matching the level it stands at and
+ * every level below it:
+ *   sensors/+/temp  matches  sensors/kitchen/temp
+ *   sensors/#       matches  sensors, sensors/kitchen, sensors/kitchen/temp
+ * Matching a path visits only the children whose level matches, so the
+ * cost depends on the matching subtrees and not on the subscription count.
+ * Callers serialize access to a trie.
+ *--------------------------------------------------------------------------
+ */
+
+/*-------------------------------------------------------------------------
+ * pstrie_levellen - length of the path level starting at level
+ *--------------------------------------------------------------------------
+ */
+local uint32 pstrie_levellen(char *level)
+{
+	uint32 len = 0;
+
+	while(level[len] != '\0' && level[len] != '/') {
+		len++;
+	}
+	return len;
+}
+
+/*-------------------------------------------------------------------------
+ * pstrie_child - child of node holding a level, NULL if there is none
+ *--------------------------------------------------------------------------
+ */
+local struct pstnode *pstrie_child(struct pstnode *node, char *level, uint32 len)
+{
+	struct pstnode *child;
+
+	for(child = node->child; child != NULL; child = child->sibling) {
+		if(strncmp(child->name, level, len) == 0 && child->name[len] == '\0') {
+			return child;
+		}
+	}
+	return NULL;
+}
+
+/*-------------------------------------------------------------------------
+ * pstrie_prune - free node and the levels above it as long as they have
+ *                neither subscriptions nor children, the root is kept
+ *--------------------------------------------------------------------------
+ */
+local void pstrie_prune(struct pstnode *node)
+{
+	struct pstnode *parent;
+	struct pstnode **prev;
+
+	while(node->parent != NULL && node->subs == NULL && node->child == NULL) {
+		parent = node->parent;
+		prev = &parent->child;
+		while(*prev != node) {
+			prev = &(*prev)->sibling;
+		}
+		*prev = node->sibling;
+		freemem((char *) node, sizeof(struct pstnode));
+		node = parent;
+	}
+}
+
+/*-------------------------------------------------------------------------
+ * pstrie_insert - add a subscription for filter below root, creating the
+ *                 nodes it needs. SYSERR for a malformed filter.
+ *--------------------------------------------------------------------------
+ */
+status pstrie_insert(struct pstnode *root, char *filter, struct pstsub *sub)
+{
+	struct pstnode *node = root;
+	struct pstnode *child;
+	char *level = filter;
+	uint32 len;
+
+	while(1) {
+		len = pstrie_levellen(level);
+		// wildcards stand alone in a level and "#" only ends a filter
+		if(len >= PSTRIE_NAMELEN
+		    || (len > 1 && (memchr(level, '+', len) != NULL || memchr(level, '#', len) != NULL))
+		    || (level[0] == '#' && level[len] != '\0')) {
+			// drop the levels made for the filter so far
+			pstrie_prune(node);
+			return SYSERR;
+		}
+
+		child = pstrie_child(node, level, len);
+		if(child == NULL) {
+			child = (struct pstnode *) getmem(sizeof(struct pstnode));
+			if(child == (struct pstnode *) SYSERR) {
+				pstrie_prune(node);
+				return SYSERR;
+			}
+			memcpy(child->name, level, len);
+			child->name[len] = '\0';
+			child->child = NULL;
+			child->subs = NULL;
+			child->parent = node;
+			child->sibling = node->child;
+			node->child = child;
+		}
+		node = child;
+
+		if(level[len] == '\0') {
+			break;
+		}
+		level += len + 1;
+	}
+
+	sub->node = node;
+	sub->next = node->subs;
+	node->subs = sub;
+	return OK;
+}
+
+/*-------------------------------------------------------------------------
+ * pstrie_remove - unlink a subscription from its node and free the nodes
+ *                 left without subscriptions or children
+ *--------------------------------------------------------------------------
+ */
+void pstrie_remove(struct pstsub *sub)
+{
+	struct pstsub **prev;
+
+	for(prev = &sub->node->subs; *prev != NULL; prev = &(*prev)->next) {
+		if(*prev == sub) {
+			*prev = sub->next;
+			break;
+		}
+	}
+	pstrie_prune(sub->node);
+}
+
+/*-------------------------------------------------------------------------
+ * pstrie_find - subscription of process pid for exactly filter, NULL if
+ *               it has none
+ *--------------------------------------------------------------------------
+ */
+struct pstsub *pstrie_find(struct pstnode *root, char *filter, pid32 pid)
+{
+	struct pstnode *node = root;
+	struct pstsub *sub;
+	char *level = filter;
+	uint32 len;
+
+	while(node != NULL) {
+		len = pstrie_levellen(level);
+		node = pstrie_child(node, level, len);
+		if(node == NULL || level[len] == '\0') {
+			break;
+		}
+		level += len + 1;
+	}
+	if(node == NULL) {
+		return NULL;
+	}
+	for(sub = node->subs; sub != NULL; sub = sub->next) {
+		if(sub->pid == pid) {
+			return sub;
+		}
+	}
+	return NULL;
+}
+
+/*-------------------------------------------------------------------------
+ * pstrie_add - append the subscriptions of a node to a match list
+ *--------------------------------------------------------------------------
+ */
+local void pstrie_add(struct pstnode *node, struct pstsub **subs, uint32 max, uint32 *n)
+{
+	struct pstsub *sub;
+
+	for(sub = node->subs; sub != NULL; sub = sub->next) {
+		if(*n < max) {
+			subs[*n] = sub;
+		}
+		(*n)++;
+	}
+}
+
+/*-------------------------------------------------------------------------
+ * pstrie_walk - match the children of node against the path from level
+ *               on, level is NULL once the whole path is matched
+ *--------------------------------------------------------------------------
+ */
+local void pstrie_walk(struct pstnode *node, char *level, struct pstsub **subs, uint32 max, uint32 *n)
+{
+	struct pstnode *child;
+	uint32 len = 0;
+
+	if(level != NULL) {
+		len = pstrie_levellen(level);
+	}
+	for(child = node->child; child != NULL; child = child->sibling) {
+		if(child->name[0] == '#') {
+			pstrie_add(child, subs, max, n);
+			continue;
+		}
+		if(level == NULL) {
+			continue;
+		}
+		if(child->name[0] == '+' || (strncmp(child->name, level, len) == 0 && child->name[len] == '\0')) {
+			if(level[len] == '\0') {
+				pstrie_add(child, subs, max, n);
+				// a "#" below the last level also matches the level itself
+				pstrie_walk(child, NULL, subs, max, n);
+			} else {
+				pstrie_walk(child, level + len + 1, subs, max, n);
+			}
+		}
+	}
+}
+
+/*-------------------------------------------------------------------------
+ * pstrie_match - collect up to max subscriptions whose filter matches a
+ *                path. Returns the number of matches, which may be more
+ *                than max.
+ *--------------------------------------------------------------------------
+ */
+uint32 pstrie_match(struct pstnode *root, char *path, struct pstsub **subs, uint32 max)
+{
+	uint32 n = 0;
+
+	pstrie_walk(root, path, subs, max, &n);
+	return n;
+}
@@ -0,0 +1,220 @@
+/* pubring_test.c - host stress test of the lock-free publishing queue */
+
+#include <xinu.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <signal.h>
+
+/* from <unistd.h>, whose syscall() clashes with the Xinu type */
+extern unsigned int alarm(unsigned int);
+
+/*-------------------------------------------------------------------------
+ * Built and run on the host with POSIX threads, see the Makefile:
+ *   make -C test && ./test/pubring_test
+ * Producers reserve single entries with pubq_reserve() and runs with
+ * pubq_reserven(), committing the entries of a run in reverse so the
+ * consumer often finds the head reserved but not committed. With one
+ * consumer every producer's entries must come out in the order they were
+ * reserved. With several consumers, as when publishers take entries for
+ * PSQ_DROPOLD, every entry must come out exactly once.
+ *--------------------------------------------------------------------------
+ */
+
+/* TEST_RING - ring entries, small so the ring is full most of the time */
+#define TEST_RING 16
+/* TEST_PRODUCERS - producer threads, TEST_ITEMS - entries each queues */
+#define TEST_PRODUCERS 8
+#define TEST_ITEMS 200000
+/* TEST_RUN - longest run a producer reserves at once */
+#define TEST_RUN 4
+/* TEST_CONSUMERS - consumer threads of the exactly once run */
+#define TEST_CONSUMERS 3
+/* TEST_SECONDS - a run not done by then lost or stuck entries */
+#define TEST_SECONDS 60
+
+struct pubqueue testq;
+/* next item each producer expects the consumer to see, single consumer run */
+uint32 expect[TEST_PRODUCERS];
+/* times each item was taken, exactly once run */
+uint8 *seen;
+volatile uint32 taken;
+volatile uint32 errors;
+
+/*-------------------------------------------------------------------------
+ * stuck - alarm handler, a run not done in TEST_SECONDS lost entries or
+ *         spins on them
+ *--------------------------------------------------------------------------
+ */
+void stuck(int sig)
+{
+	printf("pubring: run stuck with %u entries taken\n", taken);
+	fflush(stdout);
+	_Exit(1);
+}
+
+/*-------------------------------------------------------------------------
+ * getmem - host stand-in for the Xinu heap
+ *--------------------------------------------------------------------------
+ */
+char *getmem(uint32 nbytes)
+{
+	char *p = malloc(nbytes);
+
+	return (p == NULL) ? (char *) SYSERR : p;
+}
+
+/*-------------------------------------------------------------------------
+ * producer - queue TEST_ITEMS entries tagged with producer and sequence
+ *--------------------------------------------------------------------------
+ */
+void *producer(void *arg)
+{
+	uint32 pub = (uint32) (unsigned long) arg;
+	struct publishqueue *ent;
+	uint32 seed = pub + 1;
+	uint32 seq = 0;
+	uint32 pos;
+	uint32 n, got;
+	int32 i;
+
+	while(seq < TEST_ITEMS) {
+		seed = seed * 1103515245 + 12345;
+		n = 1 + (seed >> 16) % TEST_RUN;
+		if(n > TEST_ITEMS - seq) {
+			n = TEST_ITEMS - seq;
+		}
+
+		if(n == 1) {
+			ent = pubq_reserve(&testq, &pos);
+			if(ent == NULL) {
+				sched_yield();
+				continue;
+			}
+			ent->topic = pub;
+			ent->size = seq++;
+			pubq_commit(&testq, ent, pos);
+			continue;
+		}
+
+		got = pubq_reserven(&testq, n, &pos);
+		if(got == 0) {
+			sched_yield();
+			continue;
+		}
+		for(i = got - 1; i >= 0; i--) {
+			ent = &testq.ring[(pos + i) & testq.mask];
+			ent->topic = pub;
+			ent->size = seq + i;
+			pubq_commit(&testq, ent, pos + i);
+		}
+		seq += got;
+	}
+	return NULL;
+}
+
+/*-------------------------------------------------------------------------
+ * consumer - take entries until every producer's are taken, checking
+ *            order with one consumer and counting them with several
+ *--------------------------------------------------------------------------
+ */
+void *consumer(void *arg)
+{
+	int ordered = (arg != NULL);
+	struct publishqueue *ent;
+	uint32 pub, seq;
+	uint32 pos;
+
+	while(taken < TEST_PRODUCERS * TEST_ITEMS) {
+		ent = pubq_take(&testq, &pos);
+		if(ent == NULL) {
+			sched_yield();
+			continue;
+		}
+		pub = ent->topic;
+		seq = ent->size;
+		pubq_release(&testq, ent, pos);
+
+		if(pub >= TEST_PRODUCERS || seq >= TEST_ITEMS) {
+			__sync_fetch_and_add(&errors, 1);
+		} else if(ordered) {
+			if(seq != expect[pub]) {
+				if(errors < 10) {
+					printf("producer %u: got %u, expected %u\n", pub, seq, expect[pub]);
+				}
+				errors++;
+			}
+			expect[pub] = seq + 1;
+		} else if(__sync_fetch_and_add(&seen[pub * TEST_ITEMS + seq], 1) != 0) {
+			__sync_fetch_and_add(&errors, 1);
+		}
+		__sync_fetch_and_add(&taken, 1);
+	}
+	return NULL;
+}
+
+/*-------------------------------------------------------------------------
+ * run - one stress run with nconsumers consumers, returns errors found
+ *--------------------------------------------------------------------------
+ */
+uint32 run(int nconsumers)
+{
+	pthread_t prod[TEST_PRODUCERS];
+	pthread_t cons[TEST_CONSUMERS];
+	uint32 i;
+
+	if(pubq_init(&testq, TEST_RING) == SYSERR) {
+		return 1;
+	}
+	memset(expect, 0, sizeof(expect));
+	memset(seen, 0, TEST_PRODUCERS * TEST_ITEMS);
+	taken = 0;
+	errors = 0;
+	alarm(TEST_SECONDS);
+
+	for(i = 0; i < nconsumers; i++) {
+		pthread_create(&cons[i], NULL, consumer, (nconsumers == 1) ? (void *) 1 : NULL);
+	}
+	for(i = 0; i < TEST_PRODUCERS; i++) {
+		pthread_create(&prod[i], NULL, producer, (void *) (unsigned long) i);
+	}
+	for(i = 0; i < TEST_PRODUCERS; i++) {
+		pthread_join(prod[i], NULL);
+	}
+	for(i = 0; i < nconsumers; i++) {
+		pthread_join(cons[i], NULL);
+	}
+
+	if(pubq_count(&testq) != 0) {
+		errors++;
+	}
+	for(i = 0; nconsumers > 1 && i < TEST_PRODUCERS * TEST_ITEMS; i++) {
+		if(seen[i] != 1) {
+			errors++;
+		}
+	}
+	alarm(0);
+	free(testq.ring);
+	printf("pubring: %d producers %d consumer(s), %d entries, %u errors\n",
+		TEST_PRODUCERS, nconsumers, TEST_PRODUCERS * TEST_ITEMS, errors);
+	return errors;
+}
+
+/*-------------------------------------------------------------------------
+ * main - ordered run and exactly once run, exit status 1 on any error
+ *--------------------------------------------------------------------------
+ */
+int main(void)
+{
+	uint32 errors = 0;
+
+	signal(SIGALRM, stuck);
+	seen = malloc(TEST_PRODUCERS * TEST_ITEMS);
+	if(seen == NULL) {
+		return 1;
+	}
+	errors += run(1);
+	errors += run(TEST_CONSUMERS);
+	free(seen);
+	return (errors == 0) ? 0 : 1;
+}
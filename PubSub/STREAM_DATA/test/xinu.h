@@ -0,0 +1,25 @@
+/* xinu.h - host build of pubring.c for pubring_test.c */
+
+#include <stdlib.h>
+#include <stdio.h>
+
+/* kernel.h has its own definitions of these */
+#undef NULL
+#undef EOF
+
+#include "../kernel.h"
+
+#define NPROC 8
+
+#include "../pubsub.h"
+
+extern char *getmem(uint32);
+
+/* in file pubring.c */
+extern status pubq_init(struct pubqueue *, uint32);
+extern struct publishqueue *pubq_reserve(struct pubqueue *, uint32 *);
+extern uint32 pubq_reserven(struct pubqueue *, uint32, uint32 *);
+extern void pubq_commit(struct pubqueue *, struct publishqueue *, uint32);
+extern struct publishqueue *pubq_take(struct pubqueue *, uint32 *);
+extern void pubq_release(struct pubqueue *, struct publishqueue *, uint32);
+extern uint32 pubq_count(struct pubqueue *);
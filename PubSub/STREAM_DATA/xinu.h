@@ -32,6 +32,7 @@
 #include <name.h>
 #include <shell.h>
 #include <date.h>
+#include <pubsub.h>
 #include <prototypes.h>
 #include <delay.h>
 #include <stdio.h>
@@ -40,4 +41,3 @@
 #include <am335x_eth.h>
 #include <am335x_watchdog.h>
 #include <armv7a.h>
-#include <pubsub.h>
@@ -0,0 +1,148 @@
+/* xsh_pubsub.c - xsh_pubsub */
+
+#include <xinu.h>
+#include <stdio.h>
+#include <string.h>
+
+/* topics listed by one pubsub command */
+#define XSH_PSTOPICS 64
+
+/*------------------------------------------------------------------------
+ * xsh_pstopic - parse a topic given in decimal or as 0x hexadecimal
+ *------------------------------------------------------------------------
+ */
+local status xsh_pstopic(char *arg, topic32 *topic)
+{
+	uint32 base = 10;
+	uint32 v = 0;
+	uint32 d;
+	char c;
+
+	if (arg[0] == '0' && (arg[1] == 'x' || arg[1] == 'X')) {
+		base = 16;
+		arg += 2;
+	}
+	if (*arg == '\0') {
+		return SYSERR;
+	}
+	while ((c = *arg++) != '\0') {
+		if (c >= '0' && c <= '9') {
+			d = c - '0';
+		} else if (base == 16 && c >= 'a' && c <= 'f') {
+			d = c - 'a' + 10;
+		} else if (base == 16 && c >= 'A' && c <= 'F') {
+			d = c - 'A' + 10;
+		} else {
+			return SYSERR;
+		}
+		if (d >= base) {
+			return SYSERR;
+		}
+		v = v * base + d;
+	}
+	*topic = v;
+	return OK;
+}
+
+/*------------------------------------------------------------------------
+ * xsh_pshist - print the non-empty buckets of a log2 histogram
+ *------------------------------------------------------------------------
+ */
+local void xsh_pshist(char *name, uint32 *hist)
+{
+	uint32 i;
+
+	printf("%s ticks:\n", name);
+	for (i = 0; i < PSHIST_BUCKETS; i++) {
+		if (hist[i] == 0) {
+			continue;
+		}
+		if (i == 0) {
+			printf("\t%10d         0: %d\n", 0, hist[i]);
+		} else if (i == PSHIST_BUCKETS - 1) {
+			printf("\t%10d and above: %d\n", 1 << (i - 1), hist[i]);
+		} else {
+			printf("\t%10d .. %5d: %d\n", 1 << (i - 1), (1 << i) - 1, hist[i]);
+		}
+	}
+}
+
+/*------------------------------------------------------------------------
+ * xsh_pubsub - shell command to print pubsub counters, of every topic
+ *              in use or with histograms for one topic
+ *------------------------------------------------------------------------
+ */
+shellcmd xsh_pubsub(int nargs, char *args[])
+{
+	struct pubsubstats stats;
+	struct pstopicstats tstats;
+	topic32 topics[XSH_PSTOPICS];
+	topic32 topic;
+	uint32 ntopics;
+	uint32 i;
+
+	/* For argument '--help', emit help about the 'pubsub' command	*/
+
+	if (nargs == 2 && strncmp(args[1], "--help", 7) == 0) {
+		printf("Use: %s [topic]\n\n", args[0]);
+		printf("Description:\n");
+		printf("\tDisplays publisher subscriber counters, per topic\n");
+		printf("\tor with queue wait and handler run time histograms\n");
+		printf("\tfor one topic\n");
+		printf("Options:\n");
+		printf("\ttopic\t topic id, decimal or 0x hexadecimal\n");
+		printf("\t--help\t display this help and exit\n");
+		return 0;
+	}
+
+	/* Check for valid number of arguments */
+
+	if (nargs > 2) {
+		fprintf(stderr, "%s: too many arguments\n", args[0]);
+		fprintf(stderr, "Try '%s --help' for more information\n",
+				args[0]);
+		return 1;
+	}
+
+	if (nargs == 2) {
+		if (xsh_pstopic(args[1], &topic) == SYSERR) {
+			fprintf(stderr, "%s: invalid topic %s\n", args[0], args[1]);
+			return 1;
+		}
+		if (pubsub_topicstats(topic, &tstats) == SYSERR) {
+			fprintf(stderr, "%s: topic 0x%x is not in use\n", args[0], topic);
+			return 1;
+		}
+		printf("topic 0x%x: %d publishes %d deliveries %d drops %d bytes\n",
+			topic, tstats.publishes, tstats.deliveries, tstats.drops,
+			tstats.bytes);
+		printf("queue high-water mark: %d\n", tstats.qhigh);
+		xsh_pshist("publish to dispatch", tstats.hwait);
+		xsh_pshist("handler run", tstats.hrun);
+		return 0;
+	}
+
+	pubsub_getstats(&stats);
+	printf("batches %d (%d entries), blocked %d, rejected %d, dropped %d old %d new\n",
+		stats.batches, stats.batched, stats.blocked, stats.rejected,
+		stats.dropped_old, stats.dropped_new);
+	printf("no topic %d, conflated %d, filtered %d, mailbox %d queued %d dropped\n",
+		stats.no_topic, stats.conflated, stats.filtered,
+		stats.mbox_queued, stats.mbox_dropped);
+
+	ntopics = pubsub_topics(topics, XSH_PSTOPICS);
+	printf("%10s %10s %10s %10s %10s %6s\n", "topic", "publishes",
+		"deliveries", "drops", "bytes", "qhigh");
+	for (i = 0; i < ntopics && i < XSH_PSTOPICS; i++) {
+		if (pubsub_topicstats(topics[i], &tstats) == SYSERR) {
+			continue;
+		}
+		printf("0x%08x %10d %10d %10d %10d %6d\n", topics[i],
+			tstats.publishes, tstats.deliveries, tstats.drops,
+			tstats.bytes, tstats.qhigh);
+	}
+	if (ntopics > XSH_PSTOPICS) {
+		printf("... %d more topics\n", ntopics - XSH_PSTOPICS);
+	}
+	return 0;
+}